@@ -52,6 +52,77 @@
 #define BUFPIXELS 200 ///< 200 * 5 = 1000 bytes
 #endif
 
+// BMP file header (14 bytes) plus BITMAPINFOHEADER (40 bytes). Both are
+// fetched with a single read and decoded from memory; later header
+// versions only append fields that aren't used here.
+#define BMP_HEADER_BYTES 54 ///< Size of header block read in one go
+
+// Image widths are kept in 16 bits (SPIFFS_Image::w, GFXcanvas sizes, GFX
+// coordinates); wider files are rejected rather than truncated.
+#define MAX_WIDTH 32767 ///< Widest BMP accepted, in pixels
+
+// BMP read buffer is declared as 32-bit words so the conversion kernels
+// may fetch pixel data a word at a time. 3 * BUFPIXELS bytes, rounded up.
+#define SDBUF_WORDS ((3 * BUFPIXELS + 3) / 4) ///< BMP read buffer size
+
+// Pixel data is read in blocks of whole scanlines. SPIFFS charges a fixed
+// overhead per read call (object index lookup, page header checks) on top
+// of the per-page cost, so fewer, larger reads of contiguous data are
+// markedly cheaper than one call per row. The block is taken from the heap
+// for the duration of a load; the stack buffer above is the fallback.
+#define READ_BLOCK 4096 ///< Bytes per multi-row read
+
+// Horizontal runs of at least this many equal pixels are sent to the
+// display with fillRect() instead of as pixel data. Each split costs an
+// extra address window (around ten bytes of SPI commands), so shorter runs
+// aren't worth breaking a bulk transfer for.
+#define SOLID_RUN_MIN 32 ///< Shortest run drawn with fillRect()
+
+// drawScaled() and the transforming draw() collect this many output rows
+// before sending them with one drawRGBBitmap() call (one address window
+// per block, not per row).
+#define SCALE_ROWS 8 ///< Output rows per bulk write of generated pixels
+
+// Sidecar cache files hold an image already converted to RGB565: a small
+// header identifying the source BMP it was made from, then the pixels top
+// row first in native byte order, ready to read straight into the strips.
+// SPIFFS names (path included) are limited to 31 characters.
+#define SIDECAR_MAGIC 0x35363553UL ///< "S565" as a little-endian word
+#define SIDECAR_HEADER 20          ///< Magic, size, mtime, header hash, w, h
+#define SIDECAR_NAME 32            ///< Sidecar path buffer incl. NUL
+
+// Pyramid files hold one image at several scales so that small renditions
+// read only their own pixels: a header (magic, level count), a table of
+// width, height and file offset per level, then each level as RGB565 rows
+// top row first in native byte order. Level n is 1/2^n of full size.
+#define PYRAMID_MAGIC 0x35363550UL ///< "P565" as a little-endian word
+#define PYRAMID_LEVELS 4           ///< Full, 1/2, 1/4 and 1/8 size
+#define PYRAMID_HEADER (8 + 8 * PYRAMID_LEVELS) ///< Header + level table
+
+// Interlaced files store the rows of an image in four passes, each pass
+// contiguous: every 8th row, then the rows halfway between, and so on down
+// to the odd rows. A header (magic, width, height) comes first; rows are
+// RGB565 in native byte order.
+#define INTERLACE_MAGIC 0x35363549UL ///< "I565" as a little-endian word
+#define INTERLACE_HEADER 8           ///< Magic, width, height
+#define INTERLACE_PASSES 4           ///< Passes in an interlaced file
+
+#define MAX_BANDS 4      ///< Upper limit for setBands()
+#define BAND_STACK 4096  ///< Stack bytes for each ESP32 band worker task
+
+#if defined(ESP32)
+#include <esp_heap_caps.h>
+#include <esp_idf_version.h>
+#include <freertos/semphr.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0)
+#define HAVE_FAILED_ALLOC_HOOK ///< heap_caps_register_failed_alloc_callback()
+#endif
+#elif !defined(ARDUINO)
+#include <functional>
+#include <mutex>
+#include <thread>
+#endif
+
 // SPIFFS_Image CLASS ****************************************************
 // This has been created as a class here rather than in Adafruit_GFX because
 // it's a new type returned specifically by the SPIFFS_ImageReader class
@@ -59,342 +130,3959 @@
 // classes (having been designed for flash-resident bitmaps).
 
 /*!
-    @brief   Constructor.
-    @return  'Empty' SPIFFS_Image object.
+    @brief   Constructor.
+    @return  'Empty' SPIFFS_Image object.
+*/
+SPIFFS_Image::SPIFFS_Image(void)
+    : w(0), h(0), palette(NULL), numColors(0), rowIndices(NULL),
+      compression(COMPRESS_NONE), format(IMAGE_NONE), patchLeft(0),
+      patchTop(0), patchRight(0), patchBottom(0), filesys(NULL), path(NULL),
+      priority(0), busy(0), lastUse(0), next(NULL)
+{
+  for (int i = 0; i < NUM_CANVAS; i++)
+  {
+    canvas[i] = NULL;
+    canvas8[i] = NULL;
+    canvas1[i] = NULL;
+    packed[i] = NULL;
+    resident[i] = false;
+  }
+  memset(changed, 0, sizeof changed);
+  memset(solidRows, 0, sizeof solidRows);
+  memset(runRows, 0, sizeof runRows);
+}
+
+/*!
+    @brief   Destructor.
+    @return  None (void).
+*/
+SPIFFS_Image::~SPIFFS_Image(void) { dealloc(); }
+
+/*!
+    @brief   Deallocates memory associated with SPIFFS_Image object
+             and resets member variables to 'empty' state.
+    @return  None (void).
+*/
+void SPIFFS_Image::dealloc(void)
+{
+  if (path)
+    unlink(); // Lazy image, take it out of eviction's reach first
+  for (int i = 0; i < NUM_CANVAS; i++)
+  {
+    if (canvas[i] != NULL)
+    {
+      delete canvas[i];
+      canvas[i] = NULL;
+    }
+    delete canvas8[i];
+    canvas8[i] = NULL;
+    delete canvas1[i];
+    canvas1[i] = NULL;
+    free(packed[i]);
+    packed[i] = NULL;
+    resident[i] = false;
+  }
+  free(palette);
+  palette = NULL;
+  numColors = 0;
+  free(rowIndices);
+  rowIndices = NULL;
+  memset(changed, 0, sizeof changed);
+  memset(solidRows, 0, sizeof solidRows);
+  memset(runRows, 0, sizeof runRows);
+  free(path);
+  path = NULL;
+  filesys = NULL;
+  compression = COMPRESS_NONE;
+  format = IMAGE_NONE;
+  patchLeft = patchTop = patchRight = patchBottom = 0;
+}
+
+/*!
+    @brief   Test a per-row flag.
+    @param   bits
+             Row bitset (solidRows or runRows).
+    @param   row
+             Image row.
+    @return  true if the flag is set for that row.
+*/
+static inline bool testRow(const uint8_t *bits, uint16_t row)
+{
+  return bits[row >> 3] & (1 << (row & 7));
+}
+
+/*!
+    @brief   Get number of canvas strips making up the image.
+    @return  Strip count, including uniform strips whose canvas was freed.
+*/
+uint8_t SPIFFS_Image::numStrips(void) const
+{
+  return (format == IMAGE_NONE) ? 0 : (h + CANVAS_HEIGHT - 1) / CANVAS_HEIGHT;
+}
+
+/*!
+    @brief   Get height of one canvas strip.
+    @param   i
+             Strip index.
+    @return  CANVAS_HEIGHT, or less for the last strip.
+*/
+uint16_t SPIFFS_Image::stripHeight(uint8_t i) const
+{
+  uint16_t remaining = h - i * CANVAS_HEIGHT;
+  return (remaining > CANVAS_HEIGHT) ? CANVAS_HEIGHT : remaining;
+}
+
+/*!
+    @brief   Allocate a GFX 16-bit canvas for every strip of an image whose
+             dimensions have been set, and mark it as an IMAGE_16 image.
+    @return  true on success, false if any allocation failed (canvases
+             already made are kept, caller deallocates).
+*/
+bool SPIFFS_Image::allocStrips(void)
+{
+  format = IMAGE_16; // Is a GFX 16-bit canvas type
+  for (uint8_t i = 0; i < numStrips(); i++)
+  {
+    if (!(canvas[i] = new GFXcanvas16(w, stripHeight(i))) ||
+        !canvas[i]->getBuffer())
+      return false;
+  }
+  return true;
+}
+
+/*!
+    @brief   Allocate the strips of an indexed image whose dimensions have
+             been set, plus its palette and per-row index flags: a GFX
+             1-bit canvas per strip (IMAGE_1) for 1-bit sources, else a GFX
+             8-bit canvas per strip (IMAGE_8).
+    @param   depth
+             Bits per pixel of the source, 1, 4 or 8; the palette gets
+             2^depth entries.
+    @return  true on success, false if any allocation failed (whatever was
+             made is kept, caller deallocates).
+*/
+bool SPIFFS_Image::allocIndexed(uint8_t depth)
+{
+  format = (depth == 1) ? IMAGE_1 : IMAGE_8;
+  numColors = 1 << depth;
+  if (!(palette = (uint16_t *)malloc(numColors * sizeof(uint16_t))) ||
+      !(rowIndices = (uint8_t *)malloc((uint32_t)h * ((numColors + 7) / 8))))
+    return false;
+  for (uint8_t i = 0; i < numStrips(); i++)
+  {
+    if (format == IMAGE_1)
+    {
+      if (!(canvas1[i] = new GFXcanvas1(w, stripHeight(i))) ||
+          !canvas1[i]->getBuffer())
+        return false;
+    }
+    else if (!(canvas8[i] = new GFXcanvas8(w, stripHeight(i))) ||
+             !canvas8[i]->getBuffer())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+    @brief   Scan a freshly decoded 16-bit strip for solid-color content so
+             draw() can send it as fills instead of pixel data. Rows that
+             are one color are flagged in solidRows, rows containing a run
+             of at least SOLID_RUN_MIN equal pixels in runRows. A strip
+             that is entirely one color has its canvas freed, keeping only
+             that color in solidColor[].
+    @param   i
+             Strip index, canvas[i] must hold the decoded pixels.
+    @return  None (void).
+*/
+void SPIFFS_Image::findSpans(uint8_t i)
+{
+  const uint16_t *buf = canvas[i]->getBuffer();
+  uint16_t sh = stripHeight(i);
+  bool uniform = true; // Whole strip one color so far
+  for (uint16_t r = 0; r < sh; r++)
+  {
+    const uint16_t *px = &buf[r * w];
+    uint16_t longest = 0;
+    for (uint16_t a = 0; a < w;)
+    {
+      uint16_t b = a + 1;
+      while ((b < w) && (px[b] == px[a]))
+        b++;
+      if (b - a > longest)
+        longest = b - a;
+      a = b;
+    }
+    uint16_t row = i * CANVAS_HEIGHT + r;
+    uint8_t bit = 1 << (row & 7);
+    solidRows[row >> 3] &= ~bit; // Strip may be a reload
+    runRows[row >> 3] &= ~bit;
+    if (longest == w)
+      solidRows[row >> 3] |= bit;
+    else if (longest >= SOLID_RUN_MIN)
+      runRows[row >> 3] |= bit;
+    uniform &= (longest == w) && (px[0] == buf[0]);
+  }
+  if (uniform)
+  { // Keep just the color
+    solidColor[i] = buf[0];
+    delete canvas[i];
+    canvas[i] = NULL;
+  }
+}
+
+/*!
+    @brief   Scan a freshly decoded indexed strip: record which palette
+             indices each row uses in rowIndices, so drawChanged() can
+             skip rows a palette change doesn't affect, and flag rows of a
+             single index in solidRows.
+    @param   i
+             Strip index, canvas8[i] or canvas1[i] must hold the decoded
+             indices.
+    @return  None (void).
+*/
+void SPIFFS_Image::findIndices(uint8_t i)
+{
+  uint16_t flagBytes = (numColors + 7) / 8;
+  for (uint16_t r = 0; r < stripHeight(i); r++)
+  {
+    uint16_t row = i * CANVAS_HEIGHT + r;
+    uint8_t *used = &rowIndices[row * flagBytes];
+    memset(used, 0, flagBytes);
+    if (format == IMAGE_1)
+    { // A byte at a time: any set bit uses index 1, any clear bit index 0
+      const uint8_t *bits = &canvas1[i]->getBuffer()[r * ((w + 7) / 8)];
+      for (uint16_t x = 0; x < w; x += 8)
+      {
+        uint8_t valid = (w - x >= 8) ? 0xFF : (uint8_t)(0xFF00 >> (w - x));
+        used[0] |= ((bits[x >> 3] & valid) ? 2 : 0) |
+                   ((~bits[x >> 3] & valid) ? 1 : 0);
+      }
+    }
+    else
+    {
+      const uint8_t *px = &canvas8[i]->getBuffer()[r * w];
+      for (uint16_t x = 0; x < w; x++)
+        used[px[x] >> 3] |= 1 << (px[x] & 7);
+    }
+    uint8_t kinds = 0; // Distinct indices in the row, counted up to 2
+    for (uint16_t k = 0; k < flagBytes; k++)
+    {
+      if (used[k])
+        kinds += (used[k] & (used[k] - 1)) ? 2 : 1;
+    }
+    uint8_t bit = 1 << (row & 7);
+    solidRows[row >> 3] &= ~bit;
+    if (kinds == 1)
+      solidRows[row >> 3] |= bit;
+  }
+}
+
+/*!
+    @brief   Expand one row of an indexed image to 565 pixels through its
+             palette.
+    @param   row
+             Image row, 0 = top.
+    @param   dest
+             Output, w pixels.
+    @return  None (void).
+*/
+void SPIFFS_Image::expandRow(uint16_t row, uint16_t *dest) const
+{
+  uint8_t i = row / CANVAS_HEIGHT;
+  uint16_t r = row % CANVAS_HEIGHT;
+  if (format == IMAGE_1)
+  { // 8 pixels per byte through a two-entry table
+    const uint8_t *bits = &canvas1[i]->getBuffer()[r * ((w + 7) / 8)];
+    const uint16_t c[2] = {palette[0], palette[1]};
+    for (uint16_t x = 0; x < w; bits++)
+    {
+      uint8_t b = *bits;
+      for (uint8_t k = 0; (k < 8) && (x < w); k++, b <<= 1)
+        dest[x++] = c[b >> 7];
+    }
+  }
+  else
+  {
+    const uint8_t *idx = &canvas8[i]->getBuffer()[r * w];
+    for (uint16_t x = 0; x < w; x++)
+      dest[x] = palette[idx[x]];
+  }
+}
+
+/*!
+    @brief   Get width of SPIFFS_Image object.
+    @return  Width in pixels, or 0 if no image loaded.
+*/
+int16_t SPIFFS_Image::width(void) const
+{
+  if (format != IMAGE_NONE) // Image allocated?
+    return w;
+  return 0;
+}
+
+/*!
+    @brief   Get height of SPIFFS_Image object.
+    @return  Height in pixels, or 0 if no image loaded.
+*/
+int16_t SPIFFS_Image::height(void) const
+{
+  if (format != IMAGE_NONE) // Image allocated?
+    return h;
+  return 0;
+}
+
+// RLE strips are a sequence of 16-bit words: a word with the top bit set
+// is a run of (word & 0x7FFF) copies of the next word, otherwise it is a
+// count of literal 565 pixels that follow. Runs continue across rows.
+#define RLE_RUN 0x8000 ///< Run flag in an RLE count word
+#define RLE_MAX 0x7FFF ///< Longest run or literal in one count word
+
+/*!
+    @brief   Run-length encode 565 pixels.
+    @param   src
+             Pixels to encode.
+    @param   n
+             Number of pixels.
+    @param   dest
+             Output, room for n + n / RLE_MAX + 2 words.
+    @return  Number of words written to dest.
+*/
+static uint32_t rleEncode(const uint16_t *src, uint32_t n, uint16_t *dest)
+{
+  uint32_t out = 0;
+  for (uint32_t i = 0; i < n;)
+  {
+    uint32_t j = i + 1;
+    while ((j < n) && (src[j] == src[i]) && (j - i < RLE_MAX))
+      j++;
+    if (j - i >= 3)
+    { // Run
+      dest[out++] = RLE_RUN | (j - i);
+      dest[out++] = src[i];
+      i = j;
+    }
+    else
+    { // Literals up to the next run of 3 or more
+      uint32_t start = i, count = out++;
+      do
+        dest[out++] = src[i++];
+      while ((i < n) && (i - start < RLE_MAX) &&
+             !((i + 2 < n) && (src[i] == src[i + 1]) &&
+               (src[i] == src[i + 2])));
+      dest[count] = i - start;
+    }
+  }
+  return out;
+}
+
+/*!
+    @brief   Expand run-length encoded 565 pixels.
+    @param   src
+             Data written by rleEncode().
+    @param   dest
+             Output pixels.
+    @param   n
+             Number of pixels to produce.
+    @return  None (void).
+*/
+static void rleDecode(const uint16_t *src, uint16_t *dest, uint32_t n)
+{
+  while (n)
+  {
+    uint16_t count = *src++;
+    if (count & RLE_RUN)
+    {
+      count &= RLE_MAX;
+      uint16_t color = *src++;
+      for (uint16_t i = 0; i < count; i++)
+        dest[i] = color;
+    }
+    else
+    {
+      memcpy(dest, src, count * sizeof(uint16_t));
+      src += count;
+    }
+    dest += count;
+    n -= count;
+  }
+}
+
+/*!
+    @brief   Run-length encode a strip into a right-sized heap block.
+    @param   px
+             Strip pixels.
+    @param   n
+             Number of pixels.
+    @return  malloc()ed RLE data, or NULL if it wouldn't be smaller than
+             the raw pixels (or memory ran out).
+*/
+static uint8_t *rlePack(const uint16_t *px, uint32_t n)
+{
+  uint16_t *rle = (uint16_t *)malloc((n + n / RLE_MAX + 2) * sizeof(uint16_t));
+  if (rle == NULL)
+    return NULL;
+  uint32_t len = rleEncode(px, n, rle) * sizeof(uint16_t);
+  if (len >= n * sizeof(uint16_t))
+  {
+    free(rle);
+    return NULL;
+  }
+  uint8_t *fit = (uint8_t *)realloc(rle, len);
+  return fit ? fit : (uint8_t *)rle;
+}
+
+// BC1 (DXT1) strips hold 4x4 pixel blocks of 8 bytes each: two 565
+// endpoint colors c0 > c1 (little-endian), then one byte per block row
+// with a 2-bit palette index per pixel, leftmost pixel in the low bits.
+// Index 0 = c0, 1 = c1, 2 = (2*c0 + c1) / 3, 3 = (c0 + 2*c1) / 3. That is
+// a fixed 4 bits/pixel, and any block row can be decoded on its own.
+#define BC1_BLOCK 8 ///< Bytes per 4x4 block
+
+/*!
+    @brief   Encode one 4x4 block of 565 pixels to BC1. Endpoints are the
+             corners of the block's color bounding box; pixels pick the
+             nearest of the four palette steps along that axis.
+    @param   px
+             16 pixels, row-major.
+    @param   out
+             BC1_BLOCK bytes of output.
+    @return  None (void).
+*/
+static void bc1EncodeBlock(const uint16_t *px, uint8_t *out)
+{
+  int16_t lo[3] = {31, 63, 31}, hi[3] = {0, 0, 0};
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    int16_t c[3] = {(int16_t)(px[i] >> 11), (int16_t)((px[i] >> 5) & 0x3F),
+                    (int16_t)(px[i] & 0x1F)};
+    for (uint8_t k = 0; k < 3; k++)
+    {
+      if (c[k] < lo[k])
+        lo[k] = c[k];
+      if (c[k] > hi[k])
+        hi[k] = c[k];
+    }
+  }
+  // Each channel of hi is >= lo, so c0 >= c1 (4-color mode) always holds
+  uint16_t c0 = (hi[0] << 11) | (hi[1] << 5) | hi[2];
+  uint16_t c1 = (lo[0] << 11) | (lo[1] << 5) | lo[2];
+  out[0] = c0;
+  out[1] = c0 >> 8;
+  out[2] = c1;
+  out[3] = c1 >> 8;
+  // Project onto the lo->hi axis, red & blue scaled to green's 6 bits
+  int32_t d[3] = {2 * (hi[0] - lo[0]), hi[1] - lo[1], 2 * (hi[2] - lo[2])};
+  int32_t dd = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+  static const uint8_t stepIndex[4] = {1, 3, 2, 0}; // c1 ... c0
+  for (uint8_t row = 0; row < 4; row++)
+  {
+    uint8_t bits = 0;
+    for (uint8_t col = 0; col < 4; col++)
+    {
+      uint8_t step = 0;
+      if (dd)
+      {
+        uint16_t p = px[row * 4 + col];
+        int32_t t = 2 * ((p >> 11) - lo[0]) * d[0] +
+                    (((p >> 5) & 0x3F) - lo[1]) * d[1] +
+                    2 * ((p & 0x1F) - lo[2]) * d[2];
+        step = (t * 3 + dd / 2) / dd; // 0..3, rounded
+      }
+      bits |= stepIndex[step] << (col * 2);
+    }
+    out[4 + row] = bits;
+  }
+}
+
+/*!
+    @brief   BC1-encode a strip into a heap block. Partial blocks at the
+             right and bottom edges are padded by repeating the last
+             column/row.
+    @param   px
+             Strip pixels.
+    @param   w
+             Strip width.
+    @param   h
+             Strip height.
+    @return  malloc()ed block data, or NULL if memory ran out.
+*/
+static uint8_t *bc1Pack(const uint16_t *px, uint16_t w, uint16_t h)
+{
+  uint16_t bw = (w + 3) / 4, bh = (h + 3) / 4;
+  uint8_t *blocks = (uint8_t *)malloc((uint32_t)bw * bh * BC1_BLOCK);
+  if (blocks == NULL)
+    return NULL;
+  uint8_t *out = blocks;
+  uint16_t block[16];
+  for (uint16_t by = 0; by < bh; by++)
+  {
+    for (uint16_t bx = 0; bx < bw; bx++, out += BC1_BLOCK)
+    {
+      for (uint8_t i = 0; i < 16; i++)
+      {
+        uint16_t x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+        block[i] = px[((y < h) ? y : h - 1) * w + ((x < w) ? x : w - 1)];
+      }
+      bc1EncodeBlock(block, out);
+    }
+  }
+  return blocks;
+}
+
+/*!
+    @brief   Decode one pixel row of BC1 data.
+    @param   blocks
+             BC1 data of a strip, (w + 3) / 4 blocks per block row.
+    @param   w
+             Strip width in pixels.
+    @param   row
+             Pixel row within the strip.
+    @param   dest
+             Output, w pixels.
+    @return  None (void).
+*/
+static void bc1DecodeRow(const uint8_t *blocks, uint16_t w, uint16_t row,
+                         uint16_t *dest)
+{
+  const uint8_t *in = blocks + (uint32_t)(row / 4) * ((w + 3) / 4) * BC1_BLOCK;
+  for (uint16_t x = 0; x < w; x += 4, in += BC1_BLOCK)
+  {
+    uint16_t c0 = in[0] | (in[1] << 8), c1 = in[2] | (in[3] << 8);
+    uint16_t pal[4] = {c0, c1, 0, 0};
+    uint16_t r0 = c0 >> 11, g0 = (c0 >> 5) & 0x3F, b0 = c0 & 0x1F;
+    uint16_t r1 = c1 >> 11, g1 = (c1 >> 5) & 0x3F, b1 = c1 & 0x1F;
+    pal[2] = (((2 * r0 + r1) / 3) << 11) | (((2 * g0 + g1) / 3) << 5) |
+             ((2 * b0 + b1) / 3);
+    pal[3] = (((r0 + 2 * r1) / 3) << 11) | (((g0 + 2 * g1) / 3) << 5) |
+             ((b0 + 2 * b1) / 3);
+    uint8_t bits = in[4 + (row & 3)];
+    for (uint8_t col = 0; (col < 4) && (x + col < w); col++, bits >>= 2)
+      dest[x + col] = pal[bits & 3];
+  }
+}
+
+/*!
+    @brief   Replace a 16-bit canvas strip by a compressed copy, using
+             the image's compression mode. With RLE, a strip that doesn't
+             shrink keeps its canvas.
+    @param   i
+             Strip index.
+    @return  None (void).
+*/
+void SPIFFS_Image::compressStrip(uint8_t i)
+{
+  if ((compression == COMPRESS_NONE) || (canvas[i] == NULL))
+    return; // Nothing to do, or uniform strip with nothing to store
+  uint16_t sh = stripHeight(i);
+  if (compression == COMPRESS_RLE)
+    packed[i] = rlePack(canvas[i]->getBuffer(), (uint32_t)w * sh);
+  else
+    packed[i] = bc1Pack(canvas[i]->getBuffer(), w, sh);
+  if (packed[i])
+  {
+    delete canvas[i];
+    canvas[i] = NULL;
+  }
+}
+
+/*!
+    @brief   Post-process a strip whose canvas has just been decoded:
+             find solid spans, compress, and mark it resident.
+    @param   i
+             Strip index.
+    @return  None (void).
+*/
+void SPIFFS_Image::finishStrip(uint8_t i)
+{
+  if ((format == IMAGE_1) || (format == IMAGE_8))
+  {
+    findIndices(i); // Indexed strips are kept as they are
+  }
+  else
+  {
+    findSpans(i);
+    compressStrip(i);
+  }
+  resident[i] = true;
+}
+
+/*!
+    @brief   Get RAM held by one strip's pixel data.
+    @param   i
+             Strip index.
+    @return  Bytes of canvas or compressed data, 0 if not resident or
+             uniform.
+*/
+uint32_t SPIFFS_Image::stripBytes(uint8_t i) const
+{
+  uint32_t n = (uint32_t)w * stripHeight(i);
+  if (canvas[i])
+    return n * sizeof(uint16_t);
+  if (packed[i] == NULL)
+    return 0;
+  if (compression == COMPRESS_BC1)
+    return (uint32_t)((w + 3) / 4) * ((stripHeight(i) + 3) / 4) * BC1_BLOCK;
+  const uint16_t *rle = (const uint16_t *)packed[i]; // Walk the RLE words
+  uint32_t words = 0;
+  while (n)
+  {
+    uint16_t count = rle[words];
+    words += (count & RLE_RUN) ? 2 : 1 + count;
+    n -= count & RLE_MAX;
+  }
+  return words * sizeof(uint16_t);
+}
+
+/*!
+    @brief   Get the 565 pixels of one strip.
+    @param   i
+             Strip index.
+    @param   scratch
+             Buffer of w * CANVAS_HEIGHT pixels for expanding compressed
+             strips, may be NULL if the image has none.
+    @return  Canvas buffer, scratch filled with the strip, or NULL for a
+             uniform strip (see solidColor[]).
+*/
+uint16_t *SPIFFS_Image::stripPixels(uint8_t i, uint16_t *scratch) const
+{
+  if (canvas[i])
+    return canvas[i]->getBuffer();
+  if (packed[i] && scratch)
+  {
+    if (compression == COMPRESS_RLE)
+    {
+      rleDecode((const uint16_t *)packed[i], scratch,
+                (uint32_t)w * stripHeight(i));
+    }
+    else
+    {
+      for (uint16_t r = 0; r < stripHeight(i); r++)
+        bc1DecodeRow(packed[i], w, r, &scratch[r * w]);
+    }
+    return scratch;
+  }
+  return NULL;
+}
+
+/*!
+    @brief   Get the scratch buffer size rowPixels() needs for this image.
+    @return  Pixels: a whole strip if strips are compressed, else one row
+             (for uniform strips).
+*/
+uint32_t SPIFFS_Image::scratchPixels(void) const
+{
+  return (uint32_t)w * ((compression != COMPRESS_NONE) ? CANVAS_HEIGHT : 1);
+}
+
+/*!
+    @brief   Get the 565 pixels of one image row, for callers that walk
+             the image row by row. Compressed strips are expanded into the
+             scratch buffer once and reused for the following rows of the
+             same strip; lazy strips are loaded as needed. Rows of indexed
+             images are expanded through the palette each time.
+    @param   row
+             Image row, 0 = top.
+    @param   scratch
+             Buffer of scratchPixels() pixels.
+    @param   cached
+             Strip currently held in scratch, set to 0xFF before the first
+             call; updated.
+    @return  Pointer to w pixels, or NULL if a lazy strip failed to load.
+*/
+const uint16_t *SPIFFS_Image::rowPixels(uint16_t row, uint16_t *scratch,
+                                        uint8_t &cached)
+{
+  uint8_t i = row / CANVAS_HEIGHT;
+  uint16_t r = row % CANVAS_HEIGHT;
+  if (!resident[i] && ((path == NULL) || !loadStrip(i)))
+    return NULL;
+  if (palette)
+  { // Indexed
+    expandRow(row, scratch);
+    cached = 0xFF; // Scratch holds a single row
+    return scratch;
+  }
+  if (canvas[i])
+    return &canvas[i]->getBuffer()[r * w];
+  if (cached != i)
+  {
+    if (packed[i])
+    {
+      stripPixels(i, scratch);
+    }
+    else
+    { // Uniform strip, every row is the same
+      for (uint16_t x = 0; x < w; x++)
+        scratch[x] = solidColor[i];
+    }
+    cached = i;
+  }
+  return packed[i] ? &scratch[r * w] : scratch;
+}
+
+/*!
+    @brief   Draw image to an Adafruit_SPITFT-type display.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the screen edges. Screen rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  None (void). Compressed strips are expanded one at a time
+             into a scratch buffer of one strip; if that can't be
+             allocated they are skipped. Strips entirely off screen are
+             skipped too; for an image from openBMP() only the strips
+             that end up on screen are read from the file.
+*/
+void SPIFFS_Image::draw(Adafruit_SPITFT &tft, int16_t x, int16_t y)
+{
+  if (format == IMAGE_16)
+  {
+    BusyScope pin(*this);
+    uint16_t *scratch = NULL;
+    if (compression != COMPRESS_NONE)
+      scratch = (uint16_t *)malloc(w * CANVAS_HEIGHT * sizeof(uint16_t));
+    for (uint8_t i = 0; i < numStrips(); i++, y += CANVAS_HEIGHT)
+    {
+      uint16_t sh = stripHeight(i);
+      if ((y + sh <= 0) || (y >= tft.height()))
+        continue; // Off screen
+      if (!resident[i] && ((path == NULL) || !loadStrip(i)))
+        continue; // Lazy strip failed to load
+      if ((canvas[i] == NULL) && (packed[i] == NULL))
+      { // Uniform strip, only its color was kept
+        tft.fillRect(x, y, w, sh, solidColor[i]);
+        continue;
+      }
+      uint16_t *buf = stripPixels(i, scratch);
+      if (buf == NULL)
+        continue; // No scratch memory
+      uint16_t first = i * CANVAS_HEIGHT; // Image row of strip's top
+      for (uint16_t r = 0, n; r < sh; r += n)
+      {
+        uint16_t *px = &buf[r * w];
+        n = 1;
+        if (testRow(solidRows, first + r))
+        { // Merge following rows of the same color into one fill
+          while ((r + n < sh) && testRow(solidRows, first + r + n) &&
+                 (px[n * w] == px[0]))
+            n++;
+          tft.fillRect(x, y + r, w, n, px[0]);
+        }
+        else if (testRow(runRows, first + r))
+        {
+          drawRuns(tft, x, y + r, px);
+        }
+        else
+        { // Plain rows go out together as one bitmap
+          while ((r + n < sh) && !testRow(solidRows, first + r + n) &&
+                 !testRow(runRows, first + r + n))
+            n++;
+          tft.drawRGBBitmap(x, y + r, px, w, n);
+        }
+      }
+    }
+    free(scratch);
+  }
+  else if (palette)
+  {
+    drawRows(tft, x, y, NULL, NULL);
+  }
+}
+
+/*!
+    @brief   Draw one image row, sending runs of at least SOLID_RUN_MIN
+             equal pixels with fillRect() and the rest as pixel data.
+    @param   tft
+             Screen to draw to.
+    @param   x
+             Horizontal offset of the row on screen.
+    @param   y
+             Vertical offset of the row on screen.
+    @param   px
+             Row of w pixels, 565 format.
+    @return  None (void).
+*/
+void SPIFFS_Image::drawRuns(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                            uint16_t *px) const
+{
+  uint16_t start = 0; // First pixel not yet sent
+  for (uint16_t a = 0; a < w;)
+  {
+    uint16_t b = a + 1;
+    while ((b < w) && (px[b] == px[a]))
+      b++;
+    if (b - a >= SOLID_RUN_MIN)
+    {
+      if (a > start)
+        tft.drawRGBBitmap(x + start, y, &px[start], a - start, 1);
+      tft.fillRect(x + a, y, b - a, 1, px[a]);
+      start = b;
+    }
+    a = b;
+  }
+  if (w > start)
+    tft.drawRGBBitmap(x + start, y, &px[start], w - start, 1);
+}
+
+/*!
+    @brief   Spread an RGB565 pixel over 32 bits as 00000GGGGGG00000
+             RRRRR000000BBBBB, leaving room above each channel so all
+             three can be scaled by a 5-bit weight with one multiply.
+    @param   c
+             565 pixel.
+    @return  Spread pixel.
+*/
+static inline uint32_t spread565(uint16_t c)
+{
+  return (c | ((uint32_t)c << 16)) & 0x07E0F81FUL;
+}
+
+/*!
+    @brief   Inverse of spread565().
+    @param   c
+             Spread pixel.
+    @return  565 pixel.
+*/
+static inline uint16_t pack565(uint32_t c)
+{
+  return (c & 0xF81F) | ((c >> 16) & 0x07E0);
+}
+
+/*!
+    @brief   Blend two spread pixels, all channels at once.
+    @param   a
+             Spread pixel at weight 0.
+    @param   b
+             Spread pixel at weight 32.
+    @param   f
+             Weight of b, 0 to 32.
+    @return  Blended spread pixel.
+*/
+static inline uint32_t lerp565(uint32_t a, uint32_t b, uint8_t f)
+{
+  // 0x02008010 adds 16 to each channel, rounding instead of truncating
+  return ((a * (32 - f) + b * f + 0x02008010UL) >> 5) & 0x07E0F81FUL;
+}
+
+/*!
+    @brief   Draw image to an Adafruit_SPITFT-type display, scaled to any
+             size, without reloading it. Output rows are generated into a
+             small buffer and sent SCALE_ROWS at a time; only the visible
+             part of the destination is computed. Positions are tracked in
+             16.16 fixed point and bilinear weights use 5 bits, so there
+             is no floating point in the inner loops. Bilinear averages
+             the 4 nearest source pixels, which smooths enlargements and
+             is fine for reductions to about half size; below that,
+             loadPyramid() levels alias less.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Left edge of destination rectangle in pixels, may be off
+             screen (clipped).
+    @param   y
+             Top edge of destination rectangle in pixels.
+    @param   width
+             Destination width in pixels.
+    @param   height
+             Destination height in pixels.
+    @param   mode
+             SCALE_NEAREST or SCALE_BILINEAR (default).
+    @return  None (void).
+*/
+void SPIFFS_Image::drawScaled(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                              int16_t width, int16_t height,
+                              ImageScaling mode)
+{
+  if ((format == IMAGE_NONE) || (width <= 0) || (height <= 0))
+    return;
+
+  // Visible part of the destination rectangle
+  int16_t x0 = (x < 0) ? -x : 0, x1 = width;
+  int16_t y0 = (y < 0) ? -y : 0, y1 = height;
+  if (x + x1 > tft.width())
+    x1 = tft.width() - x;
+  if (y + y1 > tft.height())
+    y1 = tft.height() - y;
+  if ((x0 >= x1) || (y0 >= y1))
+    return;
+  uint16_t visW = x1 - x0;
+
+  // Bilinear reads two source rows, each with a strip cache of its own
+  bool bilinear = (mode == SCALE_BILINEAR);
+  uint32_t scratchSize = scratchPixels();
+  uint16_t *scratch = (uint16_t *)malloc(
+      scratchSize * (bilinear ? 2 : 1) * sizeof(uint16_t));
+  uint16_t *out = (uint16_t *)malloc(visW * SCALE_ROWS * sizeof(uint16_t));
+  if (!scratch || !out)
+  {
+    free(scratch);
+    free(out);
+    return;
+  }
+
+  // Source position of destination pixel centers, 16.16 fixed point.
+  // Bilinear samples between pixel centers, hence the half-pixel shift.
+  int32_t stepX = ((int32_t)w << 16) / width;
+  int32_t stepY = ((int32_t)h << 16) / height;
+  int32_t originX = stepX / 2 - (bilinear ? 0x8000 : 0) + x0 * stepX;
+  int32_t originY = stepY / 2 - (bilinear ? 0x8000 : 0);
+  int32_t maxX = (int32_t)(w - 1) << 16, maxY = (int32_t)(h - 1) << 16;
+
+  BusyScope pin(*this);
+  uint8_t cached[2] = {0xFF, 0xFF};
+  uint8_t n = 0; // Rows waiting in out
+  for (int16_t dy = y0; dy < y1; dy++)
+  {
+    int32_t fy = originY + dy * stepY;
+    fy = (fy < 0) ? 0 : (fy > maxY) ? maxY : fy;
+    uint16_t sy = fy >> 16;
+    uint16_t *o = &out[n * visW];
+    const uint16_t *a = rowPixels(sy, scratch, cached[0]);
+    if (a == NULL)
+    { // Lazy strip failed to load, leave the row as it was
+      if (n)
+        tft.drawRGBBitmap(x + x0, y + dy - n, out, visW, n);
+      n = 0;
+      continue;
+    }
+    int32_t fx = originX;
+    if (!bilinear)
+    {
+      for (uint16_t i = 0; i < visW; i++, fx += stepX)
+        o[i] = a[fx >> 16];
+    }
+    else
+    {
+      const uint16_t *b =
+          (sy + 1 < h) ? rowPixels(sy + 1, &scratch[scratchSize], cached[1])
+                       : a;
+      if (b == NULL)
+        b = a;
+      uint8_t wy = ((fy & 0xFFFF) + 0x400) >> 11; // Rounded, 0 to 32
+      for (uint16_t i = 0; i < visW; i++, fx += stepX)
+      {
+        int32_t cx = (fx < 0) ? 0 : (fx > maxX) ? maxX : fx;
+        uint16_t sx = cx >> 16;
+        uint16_t sx1 = (sx + 1 < w) ? sx + 1 : sx;
+        uint8_t wx = ((cx & 0xFFFF) + 0x400) >> 11;
+        uint32_t top = lerp565(spread565(a[sx]), spread565(a[sx1]), wx);
+        uint32_t bottom = lerp565(spread565(b[sx]), spread565(b[sx1]), wx);
+        o[i] = pack565(lerp565(top, bottom, wy));
+      }
+    }
+    if ((++n == SCALE_ROWS) || (dy == y1 - 1))
+    {
+      tft.drawRGBBitmap(x + x0, y + dy - n + 1, out, visW, n);
+      n = 0;
+    }
+  }
+  free(scratch);
+  free(out);
+}
+
+/*!
+    @brief   Set the fixed borders of a nine-patch image for
+             drawNinePatch(). The corners keep their size, the edges
+             between them stretch in one direction and the middle in
+             both. Cleared when a new image is loaded.
+    @param   left
+             Columns at the left edge that don't stretch horizontally.
+    @param   top
+             Rows at the top edge that don't stretch vertically.
+    @param   right
+             Columns at the right edge that don't stretch horizontally.
+    @param   bottom
+             Rows at the bottom edge that don't stretch vertically.
+    @return  true on success, false (borders unchanged) if no image is
+             loaded or they leave no stretchable row or column.
+*/
+bool SPIFFS_Image::setNinePatch(uint16_t left, uint16_t top, uint16_t right,
+                                uint16_t bottom)
+{
+  if ((format == IMAGE_NONE) || (left + right >= w) || (top + bottom >= h))
+    return false;
+  patchLeft = left;
+  patchTop = top;
+  patchRight = right;
+  patchBottom = bottom;
+  return true;
+}
+
+/*!
+    @brief   Map a destination position of a nine-patch to its source.
+    @param   d
+             Destination column or row, 0 to dstLen - 1.
+    @param   lead
+             Fixed pixels before the stretched part.
+    @param   trail
+             Fixed pixels after the stretched part.
+    @param   srcLen
+             Source image width or height.
+    @param   dstLen
+             Destination width or height, at least lead + trail.
+    @return  Source column or row.
+*/
+static inline uint16_t patchMap(uint16_t d, uint16_t lead, uint16_t trail,
+                                uint16_t srcLen, uint16_t dstLen)
+{
+  if (d < lead)
+    return d;
+  if (d >= dstLen - trail)
+    return srcLen - (dstLen - d);
+  return lead + (uint32_t)(d - lead) * (srcLen - lead - trail) /
+                    (dstLen - lead - trail);
+}
+
+/*!
+    @brief   Draw a block of identical rows: a fillRect() if the row is one
+             color, else one address window with the row written into it
+             once per block row.
+    @param   tft
+             Screen to draw to.
+    @param   x
+             Left edge of block.
+    @param   y
+             Top edge of block.
+    @param   bw
+             Block width (pixels in px).
+    @param   n
+             Block height.
+    @param   px
+             Pixels of the row.
+    @return  None (void).
+*/
+static void drawBlock(Adafruit_SPITFT &tft, int16_t x, int16_t y, int16_t bw,
+                      int16_t n, uint16_t *px)
+{
+  int16_t x0 = (x < 0) ? -x : 0, x1 = bw;
+  int16_t y0 = (y < 0) ? -y : 0, y1 = n;
+  if (x + x1 > tft.width())
+    x1 = tft.width() - x;
+  if (y + y1 > tft.height())
+    y1 = tft.height() - y;
+  if ((x0 >= x1) || (y0 >= y1))
+    return;
+  int16_t i = x0 + 1;
+  while ((i < x1) && (px[i] == px[x0]))
+    i++;
+  if (i == x1)
+  {
+    tft.fillRect(x + x0, y + y0, x1 - x0, y1 - y0, px[x0]);
+    return;
+  }
+  tft.startWrite();
+  tft.setAddrWindow(x + x0, y + y0, x1 - x0, y1 - y0);
+  for (int16_t r = y0; r < y1; r++)
+    tft.writePixels(&px[x0], x1 - x0);
+  tft.endWrite();
+}
+
+/*!
+    @brief   Draw a nine-patch image (see setNinePatch()) stretched to any
+             size, e.g. one small button or panel frame asset for every
+             size of button or panel. Corners are drawn as they are, edges
+             and middle are stretched by repeating source pixels. Rows of
+             the output that come from the same source row are sent as one
+             block per patch column: fillRect() where that part is a
+             single color (typical for the middle), else one address
+             window filled with the repeated row.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Left edge in pixels, may be off screen (clipped).
+    @param   y
+             Top edge in pixels.
+    @param   width
+             Width to draw in pixels. If less than the fixed columns
+             together, the whole image is scaled instead.
+    @param   height
+             Height to draw in pixels. If less than the fixed rows
+             together, the whole image is scaled instead.
+    @return  None (void).
+*/
+void SPIFFS_Image::drawNinePatch(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                                 int16_t width, int16_t height)
+{
+  if ((format == IMAGE_NONE) || (width <= 0) || (height <= 0))
+    return;
+  if ((width < patchLeft + patchRight) || (height < patchTop + patchBottom))
+  {
+    drawScaled(tft, x, y, width, height, SCALE_NEAREST);
+    return;
+  }
+
+  uint16_t *span = (uint16_t *)malloc(width * sizeof(uint16_t));
+  uint16_t *scratch = (uint16_t *)malloc(scratchPixels() * sizeof(uint16_t));
+  if (!span || !scratch)
+  {
+    free(span);
+    free(scratch);
+    return;
+  }
+  uint16_t midW = width - patchLeft - patchRight; // Stretched columns
+
+  BusyScope pin(*this);
+  uint8_t cached = 0xFF;
+  for (int16_t dy = 0, n; dy < height; dy += n)
+  {
+    // Output rows dy to dy + n - 1 all show source row sy
+    uint16_t sy = patchMap(dy, patchTop, patchBottom, h, height);
+    n = 1;
+    while ((dy + n < height) &&
+           (patchMap(dy + n, patchTop, patchBottom, h, height) == sy))
+      n++;
+    if ((y + dy + n <= 0) || (y + dy >= tft.height()))
+      continue; // Off screen
+    const uint16_t *px = rowPixels(sy, scratch, cached);
+    if (px == NULL)
+      continue; // Lazy strip failed to load
+    if (testRow(solidRows, sy))
+    {
+      tft.fillRect(x, y + dy, width, n, px[0]);
+      continue;
+    }
+    memcpy(span, px, patchLeft * sizeof(uint16_t));
+    for (uint16_t i = 0; i < midW; i++)
+      span[patchLeft + i] =
+          px[patchMap(patchLeft + i, patchLeft, patchRight, w, width)];
+    memcpy(&span[patchLeft + midW], &px[w - patchRight],
+           patchRight * sizeof(uint16_t));
+    drawBlock(tft, x, y + dy, patchLeft, n, span);
+    drawBlock(tft, x + patchLeft, y + dy, midW, n, &span[patchLeft]);
+    drawBlock(tft, x + patchLeft + midW, y + dy, patchRight, n,
+              &span[patchLeft + midW]);
+  }
+  free(span);
+  free(scratch);
+}
+
+/*!
+    @brief   Fill a rectangle with copies of the image, e.g. a background
+             texture from a small tile instead of a full-screen BMP. The
+             first copy's top left corner is at the rectangle's; copies at
+             the right and bottom are cut off. Each source row is made into
+             one span of the rectangle's (visible) width once, then sent to
+             every output row that shows it; single-color spans go out as
+             fills.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Left edge of rectangle in pixels, may be off screen (clipped).
+    @param   y
+             Top edge of rectangle in pixels.
+    @param   width
+             Rectangle width in pixels.
+    @param   height
+             Rectangle height in pixels.
+    @return  None (void).
+*/
+void SPIFFS_Image::drawTiled(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                             int16_t width, int16_t height)
+{
+  if ((format == IMAGE_NONE) || (width <= 0) || (height <= 0))
+    return;
+
+  // Visible part of the rectangle
+  int16_t x0 = (x < 0) ? -x : 0, x1 = width;
+  int16_t y0 = (y < 0) ? -y : 0, y1 = height;
+  if (x + x1 > tft.width())
+    x1 = tft.width() - x;
+  if (y + y1 > tft.height())
+    y1 = tft.height() - y;
+  if ((x0 >= x1) || (y0 >= y1))
+    return;
+  uint16_t visW = x1 - x0;
+
+  uint16_t *span = (uint16_t *)malloc(visW * sizeof(uint16_t));
+  uint16_t *scratch = (uint16_t *)malloc(scratchPixels() * sizeof(uint16_t));
+  if (!span || !scratch)
+  {
+    free(span);
+    free(scratch);
+    return;
+  }
+
+  BusyScope pin(*this);
+  uint8_t cached = 0xFF;
+  for (uint16_t sy = 0; (sy < h) && (sy < y1); sy++)
+  {
+    // First visible output row showing source row sy
+    int32_t dy = sy;
+    if (dy < y0)
+      dy += (int32_t)(y0 - dy + h - 1) / h * h;
+    if (dy >= y1)
+      continue;
+    const uint16_t *px = rowPixels(sy, scratch, cached);
+    if (px == NULL)
+      continue; // Lazy strip failed to load
+    // Output column x0 + i shows source column (x0 + i) % w
+    for (uint16_t i = 0, sx = x0 % w, n; i < visW; i += n, sx = 0)
+    {
+      n = w - sx;
+      if (n > visW - i)
+        n = visW - i;
+      memcpy(&span[i], &px[sx], n * sizeof(uint16_t));
+    }
+    uint16_t i = 1;
+    while ((i < visW) && (span[i] == span[0]))
+      i++;
+    tft.startWrite();
+    for (; dy < y1; dy += h)
+    {
+      if (i == visW)
+      { // Single color
+        tft.writeFillRect(x + x0, y + dy, visW, 1, span[0]);
+      }
+      else
+      {
+        tft.setAddrWindow(x + x0, y + dy, visW, 1);
+        tft.writePixels(span, visW);
+      }
+    }
+    tft.endWrite();
+  }
+  free(span);
+  free(scratch);
+}
+
+/*!
+    @brief   Test whether an image row uses any of a set of palette indices.
+    @param   used
+             Index flags of the row (from rowIndices).
+    @param   indices
+             Index flags to look for.
+    @param   bytes
+             Number of flag bytes in used.
+    @return  true if the two sets overlap.
+*/
+static inline bool usesIndex(const uint8_t *used, const uint8_t *indices,
+                             uint16_t bytes)
+{
+  for (uint16_t k = 0; k < bytes; k++)
+  {
+    if (used[k] & indices[k])
+      return true;
+  }
+  return false;
+}
+
+/*!
+    @brief   Draw image rows through a buffer of SCALE_ROWS rows, sent a
+             block at a time with drawRGBBitmap(); single-color rows are
+             sent as one fill. Shared by the draws that go row by row:
+             indexed images, color transforms and Adafruit_GFX targets.
+             A template so that Adafruit_SPITFT keeps its own (hiding, not
+             virtual) block drawRGBBitmap().
+    @param   gfx
+             Target to draw to.
+    @param   x
+             Horizontal offset in pixels, may be off the target (clipped).
+    @param   y
+             Vertical offset in pixels.
+    @param   transform
+             Color transform applied to every pixel, or NULL.
+    @param   indices
+             Palette index flags of an indexed image; only rows using one
+             of these are drawn. NULL to draw every row, which also clears
+             the flags drawChanged() works from.
+    @return  None (void).
+*/
+template <class GFX>
+void SPIFFS_Image::drawRows(GFX &gfx, int16_t x, int16_t y,
+                            const SPIFFS_ColorTransform *transform,
+                            const uint8_t *indices)
+{
+  if (format == IMAGE_NONE)
+    return;
+  if (indices == NULL)
+    memset(changed, 0, sizeof changed); // Nothing left for drawChanged()
+
+  // Visible rows
+  int16_t y0 = (y < 0) ? -y : 0, y1 = h;
+  if (y + y1 > gfx.height())
+    y1 = gfx.height() - y;
+  if ((y0 >= y1) || (x >= gfx.width()) || (x + w <= 0))
+    return;
+
+  // Indexed rows are expanded straight into out, others need scratch
+  uint16_t *out = (uint16_t *)malloc(w * SCALE_ROWS * sizeof(uint16_t));
+  uint16_t *scratch = NULL;
+  if (palette == NULL)
+    scratch = (uint16_t *)malloc(scratchPixels() * sizeof(uint16_t));
+  if (!out || (!palette && !scratch))
+  {
+    free(out);
+    free(scratch);
+    return;
+  }
+
+  BusyScope pin(*this);
+  uint16_t flagBytes = (numColors + 7) / 8;
+  uint8_t cached = 0xFF;
+  uint8_t n = 0; // Rows waiting in out
+  for (int16_t row = y0; row < y1; row++)
+  {
+    uint16_t *o = &out[n * w]; // Next free row of out
+    const uint16_t *px = NULL;
+    if (palette)
+    {
+      if (!indices ||
+          usesIndex(&rowIndices[row * flagBytes], indices, flagBytes))
+      {
+        expandRow(row, o);
+        px = o;
+      }
+    }
+    else
+    {
+      px = rowPixels(row, scratch, cached);
+    }
+    bool solid = px && testRow(solidRows, row);
+    uint16_t fill = 0;
+    if (solid)
+    {
+      fill = transform ? transform->apply(px[0]) : px[0];
+    }
+    else if (px)
+    {
+      if (transform)
+      {
+        for (uint16_t i = 0; i < w; i++)
+          o[i] = transform->apply(px[i]);
+      }
+      else if (px != o)
+      {
+        memcpy(o, px, w * sizeof(uint16_t));
+      }
+      n++;
+    }
+    if (n && (!px || solid || (n == SCALE_ROWS) || (row == y1 - 1)))
+    { // Send the rows before this one (and this one, unless it's skipped)
+      gfx.drawRGBBitmap(x, y + row - n + (px && !solid), out, w, n);
+      n = 0;
+    }
+    if (solid)
+      gfx.fillRect(x, y + row, w, 1, fill);
+  }
+  free(out);
+  free(scratch);
+}
+
+/*!
+    @brief   Draw image to an Adafruit_SPITFT-type display with a color
+             transform applied, e.g. a grayed-out or night-mode variant of
+             an icon. Pixels are transformed on the way out through a
+             buffer of SCALE_ROWS rows; single-color rows are sent as one
+             transformed fill.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the screen edges. Screen rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @param   transform
+             Color transform to apply.
+    @return  None (void).
+*/
+void SPIFFS_Image::draw(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                        const SPIFFS_ColorTransform &transform)
+{
+  drawRows(tft, x, y, &transform, NULL);
+}
+
+/*!
+    @brief   Draw image to any Adafruit_GFX target, e.g. a GFXcanvas1 or an
+             e-paper display. Rows go out through a buffer of SCALE_ROWS
+             rows with drawRGBBitmap(); single-color rows as one fill.
+    @param   gfx
+             Target to draw to (any Adafruit_GFX-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the target edges. Rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  None (void).
+*/
+void SPIFFS_Image::draw(Adafruit_GFX &gfx, int16_t x, int16_t y)
+{
+  drawRows(gfx, x, y, NULL, NULL);
+}
+
+/*!
+    @brief   Draw image into an offscreen GFXcanvas16, e.g. to compose a
+             full screen in PSRAM before one transfer to the panel. Both
+             sides are RGB565, so visible row spans are copied straight
+             into the canvas buffer instead of pixel by pixel. A rotated
+             canvas goes through the Adafruit_GFX path instead.
+    @param   dest
+             Canvas to draw to.
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the canvas edges.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  None (void).
+*/
+void SPIFFS_Image::draw(GFXcanvas16 &dest, int16_t x, int16_t y)
+{
+  uint16_t *buf = dest.getBuffer();
+  if ((buf == NULL) || dest.getRotation())
+  {
+    draw((Adafruit_GFX &)dest, x, y);
+    return;
+  }
+  if (format == IMAGE_NONE)
+    return;
+  memset(changed, 0, sizeof changed); // Nothing left for drawChanged()
+
+  // Visible rows and columns
+  int16_t y0 = (y < 0) ? -y : 0, y1 = h;
+  if (y + y1 > dest.height())
+    y1 = dest.height() - y;
+  int16_t x0 = (x < 0) ? -x : 0, x1 = w;
+  if (x + x1 > dest.width())
+    x1 = dest.width() - x;
+  if ((y0 >= y1) || (x0 >= x1))
+    return;
+
+  uint16_t *scratch = (uint16_t *)malloc(scratchPixels() * sizeof(uint16_t));
+  if (scratch == NULL)
+    return;
+
+  BusyScope pin(*this);
+  uint8_t cached = 0xFF;
+  for (int16_t row = y0; row < y1; row++)
+  {
+    const uint16_t *px = rowPixels(row, scratch, cached);
+    if (px)
+      memcpy(&buf[(int32_t)(y + row) * dest.width() + x + x0], &px[x0],
+             (x1 - x0) * sizeof(uint16_t));
+  }
+  free(scratch);
+}
+
+// INDEXED IMAGES *********************************************************
+// Palette BMPs are kept as indices plus a 565 palette: 1-bit files as one
+// bit per pixel (IMAGE_1), 4 and 8-bit files as one byte per pixel
+// (IMAGE_8). Changing palette entries recolors the image without decoding
+// it again, and drawChanged() resends only the rows using those entries.
+
+/*!
+    @brief   Replace palette entries of an indexed (IMAGE_1 or IMAGE_8)
+             image, e.g. to recolor a status icon. Nothing is decoded
+             again; the next draw() shows the new colors, and
+             drawChanged() redraws only the rows that use the entries that
+             changed.
+    @param   first
+             First palette index to set.
+    @param   count
+             Number of entries; stops at the end of the palette (2
+             entries for IMAGE_1, else 2^depth of the BMP).
+    @param   colors
+             count RGB565 colors.
+    @return  None (void). Does nothing for other image formats.
+*/
+void SPIFFS_Image::setPalette(uint8_t first, uint16_t count,
+                              const uint16_t *colors)
+{
+  for (uint16_t i = 0; (i < count) && (first + i < numColors); i++)
+  {
+    uint8_t n = first + i;
+    if (palette[n] != colors[i])
+    {
+      palette[n] = colors[i];
+      changed[n >> 3] |= 1 << (n & 7);
+    }
+  }
+}
+
+/*!
+    @brief   Rotate a range of palette entries by one step, for palette
+             cycling animations (flowing water, spinners, blinking LEDs):
+             each entry takes the color of the one before it, and the
+             first takes the color of the last.
+    @param   first
+             First palette index of the range.
+    @param   count
+             Number of entries in the range, at least 2; the range must
+             end within the palette.
+    @return  None (void). Does nothing for other image formats.
+*/
+void SPIFFS_Image::rotatePalette(uint8_t first, uint16_t count)
+{
+  if ((count < 2) || (first + count > numColors))
+    return;
+  uint16_t wrap = palette[first + count - 1];
+  for (uint16_t n = first + count - 1;; n--)
+  {
+    uint16_t c = (n > first) ? palette[n - 1] : wrap;
+    if (palette[n] != c)
+    {
+      palette[n] = c;
+      changed[n >> 3] |= 1 << (n & 7);
+    }
+    if (n == first)
+      break;
+  }
+}
+
+/*!
+    @brief   Redraw an indexed (IMAGE_1 or IMAGE_8) image after
+             setPalette() or rotatePalette(), sending only the rows that
+             use a palette entry changed since the image was last drawn
+             (by draw() or drawChanged()).
+             Which indices each row uses is recorded when the image is
+             loaded, so this costs no pixel scan. The image must already be
+             on screen at the same position.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the screen edges. Screen rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  None (void).
+*/
+void SPIFFS_Image::drawChanged(Adafruit_SPITFT &tft, int16_t x, int16_t y)
+{
+  if (palette == NULL)
+    return;
+  bool any = false;
+  for (uint8_t k = 0; k < PALETTE_FLAG_BYTES; k++)
+    any |= (changed[k] != 0);
+  if (any)
+    drawRows(tft, x, y, NULL, changed);
+  memset(changed, 0, sizeof changed);
+}
+
+// COLOR TRANSFORMS *******************************************************
+// Per-channel lookup tables for SPIFFS_Image::draw() with a transform.
+
+/*!
+    @brief   Constructor, makes an identity transform.
+    @return  SPIFFS_ColorTransform object.
+*/
+SPIFFS_ColorTransform::SPIFFS_ColorTransform(void) { reset(); }
+
+/*!
+    @brief   Reset to the identity transform.
+    @return  None (void).
+*/
+void SPIFFS_ColorTransform::reset(void)
+{
+  for (uint8_t i = 0; i < 64; i++)
+  {
+    if (i < 32)
+      red[i] = blue[i] = i;
+    green[i] = i;
+  }
+  gray = false;
+}
+
+/*!
+    @brief   Scale brightness.
+    @param   percent
+             100 leaves colors as they are, 50 halves them, 0 is black;
+             above 100 brightens, saturating at full intensity.
+    @return  None (void).
+*/
+void SPIFFS_ColorTransform::brightness(uint16_t percent)
+{
+  for (uint8_t i = 0; i < 64; i++)
+  {
+    uint32_t v = ((uint32_t)green[i] * percent + 50) / 100;
+    green[i] = (v > 63) ? 63 : v;
+    if (i < 32)
+    {
+      v = ((uint32_t)red[i] * percent + 50) / 100;
+      red[i] = (v > 31) ? 31 : v;
+      v = ((uint32_t)blue[i] * percent + 50) / 100;
+      blue[i] = (v > 31) ? 31 : v;
+    }
+  }
+}
+
+/*!
+    @brief   Blend colors toward a tint color, e.g. red for night mode or
+             a highlight color.
+    @param   color
+             RGB565 tint color.
+    @param   amount
+             0 leaves colors as they are, 255 replaces them with the tint.
+    @return  None (void).
+*/
+void SPIFFS_ColorTransform::tint(uint16_t color, uint8_t amount)
+{
+  uint8_t tr = color >> 11, tg = (color >> 5) & 0x3F, tb = color & 0x1F;
+  for (uint8_t i = 0; i < 64; i++)
+  {
+    green[i] = (green[i] * (255 - amount) + tg * amount + 127) / 255;
+    if (i < 32)
+    {
+      red[i] = (red[i] * (255 - amount) + tr * amount + 127) / 255;
+      blue[i] = (blue[i] * (255 - amount) + tb * amount + 127) / 255;
+    }
+  }
+}
+
+/*!
+    @brief   Invert colors (negative image).
+    @return  None (void).
+*/
+void SPIFFS_ColorTransform::invert(void)
+{
+  for (uint8_t i = 0; i < 64; i++)
+  {
+    green[i] = 63 - green[i];
+    if (i < 32)
+    {
+      red[i] = 31 - red[i];
+      blue[i] = 31 - blue[i];
+    }
+  }
+}
+
+/*!
+    @brief   Convert colors to gray (by luma) before the channel tables,
+             so tint() and brightness() still apply to the result. Unlike
+             the other builders this always happens first, whenever it is
+             called.
+    @return  None (void).
+*/
+void SPIFFS_ColorTransform::grayscale(void) { gray = true; }
+
+// SPIFFS_ImageReader CLASS **********************************************
+// Loads images from SD card to screen or RAM.
+
+/*!
+    @brief   Constructor.
+    @return  SPIFFS_ImageReader object.
+    @param   fs
+             Filesystem associated with this SPIFFS_ImageReader instance,
+             SPIFFS if not given. Any fs::FS works (LittleFS, SD, or a
+             host-side stand-in that models flash timing for benchmarks).
+             Any images to load will come from this filesystem;
+             if multiple filesystems are required, each will require its
+             own SPIFFS_ImageReader object. The filesystem does NOT need
+             to be initialized yet when passed in here (since this will
+             often be in pre-setup() declaration, but DOES need initializing
+             before any of the image loading or size functions are called!
+*/
+SPIFFS_ImageReader::SPIFFS_ImageReader(fs::FS &fs)
+    : filesys(&fs), bands(1), compression(COMPRESS_NONE), sidecar(false)
+{
+}
+
+/*!
+    @brief   Destructor.
+    @return  None (void).
+*/
+SPIFFS_ImageReader::~SPIFFS_ImageReader(void)
+{
+  // filesystem is left as-is
+}
+
+/*!
+    @brief   Set the number of row bands loadBMP() decodes in parallel.
+             Each band beyond the first is decoded by a separate worker
+             (a FreeRTOS task on ESP32, a thread on a host build) with its
+             own file handle; other platforms decode the bands in turn.
+             Each ESP32 worker needs BAND_STACK bytes of heap for its
+             stack while running.
+    @param   n
+             Number of bands, 1 (default, no workers) to MAX_BANDS.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::setBands(uint8_t n)
+{
+  bands = (n < 1) ? 1 : (n > MAX_BANDS) ? MAX_BANDS : n;
+}
+
+/*!
+    @brief   Choose how loadBMP() keeps 16-bit images in RAM.
+             COMPRESS_RLE stores each strip run-length coded if that is
+             smaller than the raw strip, and draw() expands one strip at a
+             time into a scratch buffer. Flat UI art typically shrinks
+             severalfold; photos stay raw. Loading still needs the raw
+             image's worth of RAM briefly.
+             COMPRESS_BC1 stores fixed-rate 4 bits/pixel blocks (a quarter
+             of RGB565) for photographic or gradient content where RLE
+             doesn't help; it is lossy, comparable to DXT1 textures.
+    @param   mode
+             COMPRESS_NONE (default), COMPRESS_RLE or COMPRESS_BC1.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::setCompression(ImageCompression mode)
+{
+  compression = mode;
+}
+
+/*!
+    @brief   Enable the sidecar cache for loadBMP(). The first load of
+             "/name.bmp" then also writes "/name.565", the image already
+             converted to RGB565; later loads read that instead of
+             decoding the BMP, a single read per strip with no per-pixel
+             work. The sidecar records the size, modification time and a
+             hash of the header block of the BMP it was made from and is
+             rewritten when they no longer match. Filesystems without
+             modification times (SPIFFS on ESP8266 reports 0) can't tell
+             a BMP replaced by another of the same size and header, e.g.
+             a recolored icon; delete its .565 file when doing that. The
+             sidecar takes as much flash as the image takes RAM
+             uncompressed; setCompression() still applies after loading.
+             Not used by openBMP().
+    @param   enable
+             true to read and write sidecars, false (default) to always
+             decode the BMP.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::setSidecarCache(bool enable)
+{
+  sidecar = enable;
+}
+
+/*!
+    @brief   Loads BMP image file from SD card into RAM (as one of the GFX
+             canvas object types) for use with the bitmap-drawing functions.
+             Not practical for most AVR microcontrollers, but some of the
+             more capable 32-bit micros can afford some RAM for this.
+    @param   filename
+             Name of BMP image file to load.
+    @param   img
+             SPIFFS_Image object, contents will be initialized, allocated
+             and loaded on success (else cleared).
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::loadBMP(char *filename,
+                                            SPIFFS_Image &img)
+{
+  // Call core BMP-reading function. TFT and working buffer are NULL
+  // (unused and allocated in function, respectively), X & Y position are
+  // always 0 because full image is loaded (RAM permitting). SPIFFS_Image
+  // argument is passed through, and SPI transactions are not needed when
+  // loading to RAM (bus is not shared during load).
+  return coreBMP(filename, &img);
+}
+
+// DECODE KERNELS ********************************************************
+// The per-pixel work of coreBMP() is generated as template specialisations
+// so that source depth is resolved at compile time. One kernel is picked
+// after the header is parsed; inside it there are no depth tests, and row
+// order, canvas switches and buffer refills are handled once per row or
+// chunk by scanRows() instead of being checked for every pixel. scanRows()
+// is the one BMP row reader; palette, native and e-paper decoding plug
+// their own row sinks into it.
+
+/*!
+    @brief   Convert a run of BMP pixels to RGB565.
+    @param   src
+             BMP pixel data, BPP bytes per pixel (BGR, BGRX or 555). Must
+             be 32-bit aligned (start of a read buffer).
+    @param   dest
+             Output 565 pixels.
+    @param   n
+             Number of pixels to convert.
+    @return  None (void).
+*/
+template <uint8_t BPP>
+static inline void convertRow(const uint8_t *src, uint16_t *dest, uint16_t n)
+{
+  while (n--)
+  { // 24-bit BGR or 32-bit BGRX, extra byte is skipped by the stride
+    *dest++ = ((src[2] & 0xF8) << 8) | ((src[1] & 0xFC) << 3) | (src[0] >> 3);
+    src += BPP;
+  }
+}
+
+#if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+// On little-endian targets (ESP32, ESP8266, x86 hosts) 24- and 32-bit
+// data is fetched as aligned 32-bit words and packed with shifts & masks:
+// 4 BGR pixels occupy exactly 3 words, so each group costs 3 loads rather
+// than 12 byte loads. This is the portable stand-in for SIMD on targets
+// (Xtensa) that have none.
+
+template <>
+inline void convertRow<3>(const uint8_t *src, uint16_t *dest, uint16_t n)
+{
+  const uint32_t *word = (const uint32_t *)src;
+  for (; n >= 4; n -= 4, word += 3, dest += 4)
+  {
+    uint32_t w0 = word[0]; // B0 G0 R0 B1
+    uint32_t w1 = word[1]; // G1 R1 B2 G2
+    uint32_t w2 = word[2]; // R2 B3 G3 R3
+    dest[0] = ((w0 >> 8) & 0xF800) | ((w0 >> 5) & 0x07E0) | ((w0 >> 3) & 0x1F);
+    dest[1] = (w1 & 0xF800) | ((w1 << 3) & 0x07E0) | (w0 >> 27);
+    dest[2] = ((w2 << 8) & 0xF800) | ((w1 >> 21) & 0x07E0) | ((w1 >> 19) & 0x1F);
+    dest[3] = ((w2 >> 16) & 0xF800) | ((w2 >> 13) & 0x07E0) | ((w2 >> 11) & 0x1F);
+  }
+  src = (const uint8_t *)word;
+  while (n--)
+  { // 0-3 leftover pixels
+    *dest++ = ((src[2] & 0xF8) << 8) | ((src[1] & 0xFC) << 3) | (src[0] >> 3);
+    src += 3;
+  }
+}
+
+template <>
+inline void convertRow<4>(const uint8_t *src, uint16_t *dest, uint16_t n)
+{
+  const uint32_t *word = (const uint32_t *)src;
+  while (n--)
+  { // B G R X
+    uint32_t w = *word++;
+    *dest++ = ((w >> 8) & 0xF800) | ((w >> 5) & 0x07E0) | ((w >> 3) & 0x1F);
+  }
+}
+#endif
+
+template <>
+inline void convertRow<2>(const uint8_t *src, uint16_t *dest, uint16_t n)
+{
+  while (n--)
+  { // X1R5G5B5 -> R5G6B5, green MSB replicated into the new LSB
+    uint16_t p = src[0] | (src[1] << 8);
+    *dest++ = ((p & 0x7FE0) << 1) | ((p >> 4) & 0x20) | (p & 0x1F);
+    src += 2;
+  }
+}
+
+/*!
+    @brief   Receives the pixels of one scanline, or part of one.
+    @param   ctx
+             Sink-specific destination.
+    @param   src
+             BMP pixel data of the piece, 32-bit aligned.
+    @param   row
+             Image row, 0 = top.
+    @param   x
+             Column of the first pixel in src; 0 starts a new row.
+    @param   n
+             Number of pixels in src.
+*/
+typedef void (*RowSink)(void *ctx, const uint8_t *src, int32_t row,
+                        uint16_t x, uint16_t n);
+
+/*!
+    @brief   Read a band of BMP scanlines in file order, so reads are
+             strictly sequential (no per-row seeks), and pass them to a
+             row sink. Whenever whole rows fit in the buffer, several are
+             fetched per read call; a row wider than the buffer is passed
+             on in pieces of whole pixels (whole bytes for 1 and 4-bit
+             files).
+    @param   file
+             Open BMP file, positioned anywhere.
+    @param   hdr
+             Decoded header of that file, uncompressed, 1 to 32 bits per
+             pixel.
+    @param   first
+             First scanline to read, counted in file order.
+    @param   count
+             Number of scanlines to read.
+    @param   buf
+             Working buffer for raw BMP data.
+    @param   bufSize
+             Size of buf in bytes, at least 4 and a multiple of 4.
+    @param   sink
+             Function receiving the pixels.
+    @param   ctx
+             Passed on to sink.
+    @return  true on success, false if the file ended early.
+*/
+static bool scanRows(File &file, const SPIFFS_BMPHeader &hdr, int32_t first,
+                     int32_t count, uint8_t *buf, uint16_t bufSize,
+                     RowSink sink, void *ctx)
+{
+  // BMP rows are padded (if needed) to 4-byte boundary
+  const uint32_t rowSize = ((hdr.depth * hdr.width + 31) / 32) * 4;
+  // Whole pixels per read: 24-bit pixels don't divide a 4-byte multiple
+  const uint16_t chunk = (hdr.depth == 24) ? (bufSize / 3) * 3 : bufSize;
+  const int32_t rowsPerRead = bufSize / rowSize; // 0 if a row won't fit
+  const int32_t end = first + count;
+
+  if (!file.seek(hdr.offset + first * rowSize))
+    return false;
+  for (int32_t n = first; n < end;)
+  {
+    yield(); // Keep ESP8266 happy
+
+    if (rowsPerRead)
+    { // Fetch as many whole rows as fit with one read call
+      int32_t rows = end - n;
+      if (rows > rowsPerRead)
+        rows = rowsPerRead;
+      uint32_t len = rows * rowSize;
+      if (file.read(buf, len) != len)
+        return false;
+      for (const uint8_t *src = buf; rows--; src += rowSize, n++)
+        sink(ctx, src, hdr.flip ? (hdr.height - 1 - n) : n, 0, hdr.width);
+    }
+    else
+    { // Row is wider than the buffer, pass it on in chunks
+      int32_t row = hdr.flip ? (hdr.height - 1 - n) : n;
+      uint16_t x = 0;
+      for (uint32_t left = rowSize; left;)
+      {
+        uint16_t len = (left > chunk) ? chunk : left;
+        if (file.read(buf, len) != len)
+          return false;
+        uint32_t num = (uint32_t)len * 8 / hdr.depth;
+        if (num > (uint32_t)(hdr.width - x))
+          num = hdr.width - x; // Trailing padding isn't a pixel
+        if (num)
+          sink(ctx, buf, row, x, num);
+        x += num;
+        left -= len;
+      }
+      n++;
+    }
+  }
+  return true;
+}
+
+/// Destination of stripSink() and indexSink(), strips of CANVAS_HEIGHT rows
+struct StripDest
+{
+  GFXcanvas16 *const *canvas16; ///< RGB565 strips, or NULL
+  GFXcanvas8 *const *canvas8;   ///< Index strips (4 and 8-bit), or NULL
+  GFXcanvas1 *const *canvas1;   ///< Bit strips (1-bit), or NULL
+  int32_t width;                ///< Image width in pixels
+};
+
+/*!
+    @brief   Row sink converting BMP pixels to RGB565 into canvas strips,
+             one specialisation per source depth.
+    @param   ctx
+             StripDest holding GFXcanvas16 strips.
+    @param   src
+             BMP pixel data, BPP bytes per pixel.
+    @param   row
+             Image row, 0 = top.
+    @param   x
+             Column of the first pixel.
+    @param   n
+             Number of pixels.
+    @return  None (void).
+*/
+template <uint8_t BPP>
+static void stripSink(void *ctx, const uint8_t *src, int32_t row, uint16_t x,
+                      uint16_t n)
+{
+  const StripDest *sd = (const StripDest *)ctx;
+  uint16_t *dest = sd->canvas16[row / CANVAS_HEIGHT]->getBuffer();
+  convertRow<BPP>(src, dest + (row % CANVAS_HEIGHT) * sd->width + x, n);
+}
+
+/*!
+    @brief   Decode a band of BMP scanlines into canvas strips.
+    @param   file
+             Open BMP file, positioned anywhere.
+    @param   hdr
+             Decoded header of that file.
+    @param   canvas
+             Array of allocated strips, CANVAS_HEIGHT rows each.
+    @param   first
+             First scanline to decode, counted in file order.
+    @param   count
+             Number of scanlines to decode.
+    @param   buf
+             Working buffer for raw BMP data.
+    @param   bufSize
+             Size of buf in bytes, at least BPP and a multiple of 4.
+    @return  true on success, false if the file ended early.
+*/
+template <uint8_t BPP>
+static bool decodeRows(File &file, const SPIFFS_BMPHeader &hdr,
+                       GFXcanvas16 *const *canvas, int32_t first,
+                       int32_t count, uint8_t *buf, uint16_t bufSize)
+{
+  StripDest sd = {canvas, NULL, NULL, hdr.width};
+  return scanRows(file, hdr, first, count, buf, bufSize, stripSink<BPP>,
+                  &sd);
+}
+
+/// Signature shared by all decodeRows() specialisations
+typedef bool (*DecodeKernel)(File &, const SPIFFS_BMPHeader &,
+                             GFXcanvas16 *const *, int32_t, int32_t,
+                             uint8_t *, uint16_t);
+
+/*!
+    @brief   Select the decode kernel matching a BMP header, whatever the
+             image height; for streaming, which only ever holds one strip.
+    @param   hdr
+             Decoded BMP header.
+    @return  Kernel function, or NULL if the format isn't supported or the
+             image is wider than MAX_WIDTH.
+*/
+static DecodeKernel formatKernel(const SPIFFS_BMPHeader &hdr)
+{
+  if ((hdr.planes != 1) || (hdr.compression != 0))
+    return NULL; // Only uncompressed is handled
+  if ((hdr.width <= 0) || (hdr.width > MAX_WIDTH) || (hdr.height <= 0))
+    return NULL;
+  switch (hdr.depth)
+  {
+  case 16:
+    return decodeRows<2>;
+  case 24:
+    return decodeRows<3>;
+  case 32:
+    return decodeRows<4>;
+  }
+  return NULL;
+}
+
+/*!
+    @brief   Select the decode kernel matching a BMP header, for an image
+             held in RAM.
+    @param   hdr
+             Decoded BMP header.
+    @return  Kernel function, or NULL if the format isn't supported or the
+             image doesn't fit in NUM_CANVAS strips.
+*/
+static DecodeKernel selectKernel(const SPIFFS_BMPHeader &hdr)
+{
+  if (hdr.height > NUM_CANVAS * CANVAS_HEIGHT)
+    return NULL;
+  return formatKernel(hdr);
+}
+
+/*!
+    @brief   Read the color table of a palette BMP and convert it to 565.
+    @param   file
+             Open BMP file, positioned anywhere.
+    @param   hdr
+             Decoded header of that file, hdr.colors at most 2^depth.
+    @param   palette
+             Output, 2^depth entries; those past hdr.colors are set to
+             black.
+    @param   buf
+             Working buffer for raw BMP data.
+    @param   bufSize
+             Size of buf in bytes, at least 4.
+    @return  true on success, false if the file ended early.
+*/
+static bool readPalette(File &file, const SPIFFS_BMPHeader &hdr,
+                        uint16_t *palette, uint8_t *buf, uint16_t bufSize)
+{
+  uint8_t entry = (hdr.headerSize == 12) ? 3 : 4; // RGBTRIPLE or RGBQUAD
+  uint16_t perRead = bufSize / entry;
+  memset(palette, 0, (1 << hdr.depth) * sizeof(uint16_t));
+  // Color table follows the 14-byte file header and the DIB header
+  if (!file.seek(14 + hdr.headerSize))
+    return false;
+  for (uint16_t i = 0; i < hdr.colors;)
+  {
+    uint16_t n = hdr.colors - i;
+    if (n > perRead)
+      n = perRead;
+    if (file.read(buf, n * entry) != (size_t)n * entry)
+      return false;
+    for (const uint8_t *p = buf; n--; p += entry) // B G R (X)
+      palette[i++] = ((p[2] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[0] >> 3);
+  }
+  return true;
+}
+
+/*!
+    @brief   Row sink storing palette indices into index strips, one
+             specialisation per source depth. 1-bit rows (MSB leftmost,
+             as in GFXcanvas1) and 8-bit rows are copied as they are;
+             4-bit rows are unpacked to a byte per pixel.
+    @param   ctx
+             StripDest holding GFXcanvas1 (1-bit) or GFXcanvas8 strips.
+    @param   src
+             BMP pixel data.
+    @param   row
+             Image row, 0 = top.
+    @param   x
+             Column of the first pixel, on a byte boundary of src's row.
+    @param   n
+             Number of pixels.
+    @return  None (void).
+*/
+template <uint8_t DEPTH>
+static void indexSink(void *ctx, const uint8_t *src, int32_t row, uint16_t x,
+                      uint16_t n)
+{
+  const StripDest *sd = (const StripDest *)ctx;
+  uint16_t r = row % CANVAS_HEIGHT;
+  if (DEPTH == 1)
+  {
+    uint32_t stride = (sd->width + 7) / 8;
+    memcpy(sd->canvas1[row / CANVAS_HEIGHT]->getBuffer() + r * stride + x / 8,
+           src, (n + 7) / 8);
+    return;
+  }
+  uint8_t *dest =
+      sd->canvas8[row / CANVAS_HEIGHT]->getBuffer() + r * sd->width + x;
+  if (DEPTH == 8)
+  {
+    memcpy(dest, src, n);
+    return;
+  }
+  for (uint16_t k = 0; k < n; k += 2, src++)
+  { // Two pixels per byte, leftmost in the high nibble
+    dest[k] = *src >> 4;
+    if (k + 1 < n)
+      dest[k + 1] = *src & 0x0F;
+  }
+}
+
+/*!
+    @brief   Read the pixel data of a 1, 4 or 8-bit palette BMP into index
+             strips.
+    @param   file
+             Open BMP file, positioned anywhere.
+    @param   hdr
+             Decoded header of that file.
+    @param   canvas8
+             Array of allocated 8-bit strips, CANVAS_HEIGHT rows each, for
+             4 and 8-bit files.
+    @param   canvas1
+             Array of allocated 1-bit strips, CANVAS_HEIGHT rows each, for
+             1-bit files.
+    @param   buf
+             Working buffer for raw BMP data.
+    @param   bufSize
+             Size of buf in bytes.
+    @return  true on success, false if the file ended early.
+*/
+static bool decodeIndexed(File &file, const SPIFFS_BMPHeader &hdr,
+                          GFXcanvas8 *const *canvas8,
+                          GFXcanvas1 *const *canvas1, uint8_t *buf,
+                          uint16_t bufSize)
+{
+  StripDest sd = {NULL, canvas8, canvas1, hdr.width};
+  RowSink sink = (hdr.depth == 1)   ? indexSink<1>
+                 : (hdr.depth == 4) ? indexSink<4>
+                                    : indexSink<8>;
+  return scanRows(file, hdr, 0, hdr.height, buf, bufSize, sink, &sd);
+}
+
+/*!
+    @brief   Get a READ_BLOCK-sized buffer for multi-row reads from the
+             heap, or fall back to a smaller caller-provided buffer.
+    @param   fallback
+             Stack buffer used if the heap allocation fails.
+    @param   fallbackSize
+             Size of fallback in bytes.
+    @param   bufSize
+             Set to the size of the returned buffer.
+    @return  Buffer to use; free() it if it isn't fallback.
+*/
+static uint8_t *allocReadBlock(uint8_t *fallback, uint16_t fallbackSize,
+                               uint16_t &bufSize)
+{
+  uint8_t *buf = (uint8_t *)malloc(READ_BLOCK);
+  if (buf)
+  {
+    bufSize = READ_BLOCK;
+    return buf;
+  }
+  bufSize = fallbackSize;
+  return fallback;
+}
+
+// PARALLEL BANDS **********************************************************
+// With setBands(n) > 1 the pixel array is split into n runs of scanlines.
+// The calling task decodes the first band through its own File; each of
+// the others is decoded by a worker with a separate File handle, writing
+// disjoint rows of the same canvas strips. On ESP32 the workers are
+// FreeRTOS tasks free to run on either core (flash access itself is still
+// serialized by the SPIFFS driver, so the gain is in the conversion work);
+// on a non-Arduino host build they are std::threads.
+
+/*!
+    @brief   One band of scanlines handed to a decode worker.
+*/
+struct DecodeBand
+{
+  fs::FS *filesys;               ///< Filesystem holding the file
+  const char *filename;          ///< File to open for this band
+  const SPIFFS_BMPHeader *hdr;   ///< Header shared by all bands
+  DecodeKernel kernel;           ///< Row decoder shared by all bands
+  GFXcanvas16 *const *canvas;    ///< Destination strips
+  int32_t first;                 ///< First scanline, in file order
+  int32_t count;                 ///< Number of scanlines
+  bool ok;                       ///< Result, valid after join
+#if defined(ESP32)
+  SemaphoreHandle_t done;        ///< Given by the worker when finished
+#elif !defined(ARDUINO)
+  std::thread worker;            ///< Host thread decoding this band
+#endif
+};
+
+/*!
+    @brief   Decode one band through a File handle of its own.
+    @param   band
+             Band description, band.ok is set on return.
+    @return  None (void).
+*/
+static void decodeBand(DecodeBand &band)
+{
+  uint32_t sdbuf[SDBUF_WORDS];
+  uint16_t bufSize;
+  uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+  File file = band.filesys->open(band.filename, FILE_READ);
+  band.ok = file && band.kernel(file, *band.hdr, band.canvas, band.first,
+                                band.count, buf, bufSize);
+  file.close();
+  if (buf != (uint8_t *)sdbuf)
+    free(buf);
+}
+
+#if defined(ESP32)
+/*!
+    @brief   FreeRTOS task body for a band worker.
+    @param   arg
+             Pointer to the DecodeBand to process.
+    @return  None (task deletes itself).
+*/
+static void bandTask(void *arg)
+{
+  DecodeBand *band = (DecodeBand *)arg;
+  decodeBand(*band);
+  xSemaphoreGive(band->done);
+  vTaskDelete(NULL);
+}
+#endif
+
+/*!
+    @brief   Start decoding a band in the background, or decode it right
+             away if no worker can be started on this platform.
+    @param   band
+             Band description; must stay valid until joinBand().
+    @return  None (void).
+*/
+static void startBand(DecodeBand &band)
+{
+#if defined(ESP32)
+  if ((band.done = xSemaphoreCreateBinary()) &&
+      (xTaskCreate(bandTask, "bmpband", BAND_STACK, &band,
+                   uxTaskPriorityGet(NULL), NULL) == pdPASS))
+    return;
+  if (band.done)
+  {
+    vSemaphoreDelete(band.done);
+    band.done = NULL;
+  }
+#elif !defined(ARDUINO)
+  band.worker = std::thread(decodeBand, std::ref(band));
+  return;
+#endif
+  decodeBand(band); // No worker, decode inline
+}
+
+/*!
+    @brief   Wait for a band started with startBand() to finish.
+    @param   band
+             Band description.
+    @return  true if the band decoded successfully.
+*/
+static bool joinBand(DecodeBand &band)
+{
+#if defined(ESP32)
+  if (band.done)
+  {
+    xSemaphoreTake(band.done, portMAX_DELAY);
+    vSemaphoreDelete(band.done);
+  }
+#elif !defined(ARDUINO)
+  band.worker.join();
+#endif
+  return band.ok;
+}
+
+// MEMORY PRESSURE ********************************************************
+// Every image from openBMP() is linked into a registry so its strips can
+// be reclaimed when another subsystem runs short of heap. Eviction goes
+// by setPriority() (lowest first), then least recently drawn. The registry
+// lock is a recursive mutex so eviction can be triggered from within the
+// library's own allocations; images being drawn are flagged busy and
+// skipped rather than freed under the drawing task's feet.
+
+SPIFFS_Image *SPIFFS_Image::lazyImages = NULL;
+uint32_t SPIFFS_Image::useCounter = 0;
+bool SPIFFS_Image::hookInstalled = false;
+volatile bool SPIFFS_Image::hookMissed = false;
+
+#if defined(ESP32)
+static SemaphoreHandle_t registryMutex = xSemaphoreCreateRecursiveMutex();
+
+/*!
+    @brief   Take the image registry lock.
+    @param   wait
+             true to block until available, false to give up at once.
+    @return  true if the lock is now held.
+*/
+static bool lockRegistry(bool wait)
+{
+  return xSemaphoreTakeRecursive(registryMutex, wait ? portMAX_DELAY : 0) ==
+         pdTRUE;
+}
+
+/*!
+    @brief   Release the image registry lock.
+    @return  None (void).
+*/
+static void unlockRegistry(void) { xSemaphoreGiveRecursive(registryMutex); }
+#elif !defined(ARDUINO)
+static std::recursive_mutex registryMutex;
+
+static bool lockRegistry(bool wait)
+{
+  if (wait)
+    registryMutex.lock();
+  return wait || registryMutex.try_lock();
+}
+
+static void unlockRegistry(void) { registryMutex.unlock(); }
+#else
+// Single task platforms (ESP8266), nothing to lock
+static bool lockRegistry(bool wait)
+{
+  (void)wait;
+  return true;
+}
+static void unlockRegistry(void) {}
+#endif
+
+/*!
+    @brief   Add this image to the registry of reclaimable images.
+    @return  None (void).
+*/
+void SPIFFS_Image::link(void)
+{
+  lockRegistry(true);
+  next = lazyImages;
+  lazyImages = this;
+  unlockRegistry();
+}
+
+/*!
+    @brief   Remove this image from the registry, if present.
+    @return  None (void).
+*/
+void SPIFFS_Image::unlink(void)
+{
+  lockRegistry(true);
+  for (SPIFFS_Image **p = &lazyImages; *p; p = &(*p)->next)
+  {
+    if (*p == this)
+    {
+      *p = next;
+      break;
+    }
+  }
+  next = NULL;
+  unlockRegistry();
+}
+
+/*!
+    @brief   Mark the image as being drawn (or done drawing), so eviction
+             leaves it alone meanwhile. Calls nest, so overlapping draws
+             from several tasks keep it busy until the last one ends.
+    @param   inUse
+             true when drawing starts, false when it ends.
+    @return  None (void).
+*/
+void SPIFFS_Image::setBusy(bool inUse)
+{
+  lockRegistry(true);
+  if (inUse)
+  {
+    busy++;
+    lastUse = ++useCounter;
+  }
+  else
+  {
+    busy--;
+  }
+  unlockRegistry();
+}
+
+/*!
+    @brief   Mark an image busy until the end of the enclosing scope.
+             Images loaded with loadBMP() are never evicted and are left
+             unmarked.
+    @param   img
+             Image about to be drawn or read.
+*/
+SPIFFS_Image::BusyScope::BusyScope(SPIFFS_Image &img) : image(img)
+{
+  if (image.path)
+    image.setBusy(true);
+}
+
+/*!
+    @brief   Clear the busy mark set by the constructor.
+*/
+SPIFFS_Image::BusyScope::~BusyScope(void)
+{
+  if (image.path)
+    image.setBusy(false);
+}
+
+/*!
+    @brief   Free strips of registered images until enough memory has been
+             reclaimed. Registry lock must be held.
+    @param   bytes
+             Number of bytes wanted.
+    @return  Number of bytes actually freed.
+*/
+uint32_t SPIFFS_Image::evict(uint32_t bytes)
+{
+  uint32_t freed = 0;
+  while (freed < bytes)
+  {
+    SPIFFS_Image *victim = NULL;
+    for (SPIFFS_Image *img = lazyImages; img; img = img->next)
+    {
+      if (img->busy)
+        continue; // Its drawing task may be loading strips right now
+      bool holdsStrips = false;
+      for (uint8_t i = 0; i < img->numStrips(); i++)
+        holdsStrips |= img->resident[i];
+      if (!holdsStrips)
+        continue;
+      if (!victim || (img->priority < victim->priority) ||
+          ((img->priority == victim->priority) &&
+           (img->lastUse < victim->lastUse)))
+        victim = img;
+    }
+    if (victim == NULL)
+      break; // Nothing left to give
+    freed += victim->freeStrips();
+  }
+  return freed;
+}
+
+/*!
+    @brief   Reclaim memory held by images from openBMP(), e.g. before
+             starting a TLS connection. Strips are freed image by image,
+             lowest priority and least recently drawn first, until at
+             least the requested amount is free; they are decoded again
+             when next drawn.
+    @param   bytes
+             Number of bytes wanted; pass 0xFFFFFFFF to free everything.
+    @return  Number of bytes actually freed (may be less, or a little
+             more, than requested).
+*/
+uint32_t SPIFFS_Image::releaseMemory(uint32_t bytes)
+{
+  lockRegistry(true);
+  uint32_t freed = evict(bytes);
+  unlockRegistry();
+  return freed;
+}
+
+/*!
+    @brief   Failed-allocation hook installed by registerPressureHandler():
+             frees as many bytes of image strips as the failed allocation
+             asked for. The hook is only a notification, that allocation
+             still fails; the memory is there for later ones. Skips
+             eviction if another task holds the registry lock.
+    @param   size
+             Size of the allocation that failed.
+    @param   caps
+             Heap capabilities requested (unused).
+    @param   function_name
+             Allocating function (unused).
+    @return  None (void).
+*/
+void SPIFFS_Image::pressureHandler(size_t size, uint32_t caps,
+                                   const char *function_name)
+{
+  (void)caps;
+  (void)function_name;
+  if (lockRegistry(false))
+  {
+    evict(size);
+    unlockRegistry();
+  }
+  else
+  {
+    hookMissed = true;
+  }
+}
+
+/*!
+    @brief   Install releaseMemory() as the system's memory-pressure
+             handler, so any failed heap allocation anywhere in the
+             program frees image strips. ESP-IDF only reports the failure
+             and doesn't retry, so the failed allocation itself still
+             returns NULL; the freed memory serves the allocations that
+             follow (e.g. the caller's own retry). Strips the library
+             itself fails to allocate are retried after releasing memory.
+             ESP-IDF allows one such handler, this replaces any other.
+    @return  true if installed, false if the platform has no such hook
+             (call releaseMemory() yourself there).
+*/
+bool SPIFFS_Image::registerPressureHandler(void)
+{
+#if defined(HAVE_FAILED_ALLOC_HOOK)
+  hookInstalled =
+      heap_caps_register_failed_alloc_callback(pressureHandler) == ESP_OK;
+  return hookInstalled;
+#else
+  return false;
+#endif
+}
+
+// LAZY STRIPS ************************************************************
+// An image from openBMP() keeps the file name and header instead of pixel
+// data; draw() decodes each strip the first time it becomes visible, and
+// releaseStrips() returns them to the heap.
+
+/*!
+    @brief   Decode one strip of an image opened with openBMP(). If the
+             strip can't be allocated, strips of other registered images
+             are released (see releaseMemory()), unless the pressure
+             handler already did so, and allocation is tried once more.
+    @param   i
+             Strip index.
+    @return  true on success, false if the file or memory is unavailable.
+*/
+bool SPIFFS_Image::loadStrip(uint8_t i)
+{
+  DecodeKernel kernel = selectKernel(bmp);
+  uint16_t sh = stripHeight(i);
+  if (kernel == NULL)
+    return false;
+  hookMissed = false;
+  canvas[i] = new GFXcanvas16(w, sh);
+  if (!canvas[i] || !canvas[i]->getBuffer())
+  { // Reclaim strips of other images and try once more
+    delete canvas[i];
+    if (!hookInstalled || hookMissed) // Else the hook has freed them
+      releaseMemory((uint32_t)w * sh * sizeof(uint16_t));
+    canvas[i] = new GFXcanvas16(w, sh);
+  }
+  if (!canvas[i] || !canvas[i]->getBuffer())
+  {
+    delete canvas[i];
+    canvas[i] = NULL;
+    return false;
+  }
+  uint32_t sdbuf[SDBUF_WORDS];
+  uint16_t bufSize;
+  uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+  // Strip rows as scanlines in file order (bottom-to-top if flipped)
+  int32_t top = i * CANVAS_HEIGHT;
+  int32_t first = bmp.flip ? (h - top - sh) : top;
+  File file = filesys->open(path, FILE_READ);
+  bool ok = file && kernel(file, bmp, canvas, first, sh, buf, bufSize);
+  file.close();
+  if (buf != (uint8_t *)sdbuf)
+    free(buf);
+  if (!ok)
+  {
+    delete canvas[i];
+    canvas[i] = NULL;
+    return false;
+  }
+  finishStrip(i);
+  return true;
+}
+
+/*!
+    @brief   Free the pixel data of an image opened with
+             SPIFFS_ImageReader::openBMP(). Released strips are decoded
+             from the file again the next time draw() needs them. Images
+             loaded with loadBMP() can't be reloaded and are left alone.
+             Strips of an image that is being drawn by another task are
+             kept.
+    @return  Number of bytes freed.
+*/
+uint32_t SPIFFS_Image::releaseStrips(void)
+{
+  uint32_t freed = 0;
+  lockRegistry(true);
+  if ((path != NULL) && !busy) // Lazily backed and not in use?
+    freed = freeStrips();
+  unlockRegistry();
+  return freed;
+}
+
+/*!
+    @brief   Free all resident strips of a lazy image. Registry lock must
+             be held and the image must not be busy.
+    @return  Number of bytes freed.
+*/
+uint32_t SPIFFS_Image::freeStrips(void)
+{
+  uint32_t freed = 0;
+  for (uint8_t i = 0; i < numStrips(); i++)
+  {
+    freed += stripBytes(i);
+    delete canvas[i];
+    canvas[i] = NULL;
+    free(packed[i]);
+    packed[i] = NULL;
+    resident[i] = false;
+  }
+  return freed;
+}
+
+// SIDECAR CACHE **********************************************************
+// Optional pre-converted copies of BMP files, see setSidecarCache().
+
+/*!
+    @brief   Derive the sidecar file name for a BMP file: its extension
+             (if any) replaced by ".565".
+    @param   filename
+             Name of BMP image file.
+    @param   name
+             Buffer of SIDECAR_NAME bytes, sidecar name returned.
+    @return  true on success, false if the name would be too long or
+             is the BMP file's own name (a BMP named *.565), so no
+             sidecar is used.
+*/
+bool SPIFFS_ImageReader::sidecarName(const char *filename, char *name)
+{
+  const char *slash = strrchr(filename, '/');
+  const char *dot = strrchr(filename, '.');
+  size_t len = (dot && (!slash || dot > slash)) ? (size_t)(dot - filename)
+                                                : strlen(filename);
+  if (len + 5 > SIDECAR_NAME)
+    return false;
+  memcpy(name, filename, len);
+  strcpy(&name[len], ".565");
+  return strcmp(name, filename) != 0;
+}
+
+/*!
+    @brief   Hash the header block of a BMP file (FNV-1a), part of the key
+             that ties a sidecar to the BMP it was made from.
+    @param   bmpFile
+             The BMP file, open; left at an unspecified position.
+    @return  32-bit hash of up to BMP_HEADER_BYTES leading bytes.
+*/
+static uint32_t headerHash(File &bmpFile)
+{
+  uint8_t buf[BMP_HEADER_BYTES];
+  size_t len = bmpFile.seek(0) ? bmpFile.read(buf, sizeof buf) : 0;
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ buf[i]) * 16777619UL;
+  return hash;
+}
+
+/*!
+    @brief   Allocate and fill an image's strips from raw RGB565 rows, top
+             row first, at the current position of an open file. One read
+             per strip. Image dimensions must already be set; strips are
+             left uncompressed for the caller to finish.
+    @param   file
+             Open file positioned at the first pixel.
+    @param   img
+             Image to fill.
+    @return  true on success, false on allocation failure or short read
+             (image partly allocated, caller deallocates).
+*/
+bool SPIFFS_ImageReader::readRaw(File &file, SPIFFS_Image *img)
+{
+  if (!img->allocStrips())
+    return false;
+  for (uint8_t i = 0; i < img->numStrips(); i++)
+  {
+    size_t bytes = (size_t)img->w * img->stripHeight(i) * 2;
+    if (file.read((uint8_t *)img->canvas[i]->getBuffer(), bytes) != bytes)
+      return false;
+  }
+  return true;
+}
+
+/*!
+    @brief   Load an image from the sidecar of a BMP file, if there is one
+             and it was made from this version of the BMP.
+    @param   bmpFile
+             The BMP file, open; used for its size, modification time and
+             header.
+    @param   filename
+             Name of the BMP file.
+    @param   img
+             Image to load, dimensions already set from the BMP header.
+    @return  true if the image was loaded, false if the BMP has to be
+             decoded (image left deallocated).
+*/
+bool SPIFFS_ImageReader::loadSidecar(File &bmpFile, const char *filename,
+                                     SPIFFS_Image *img)
+{
+  char name[SIDECAR_NAME];
+  uint8_t head[SIDECAR_HEADER];
+  File file;
+
+  if (!sidecarName(filename, name) || !filesys->exists(name) ||
+      !(file = filesys->open(name, FILE_READ)))
+    return false;
+
+  bool ok = (file.read(head, sizeof head) == sizeof head) &&
+            (readLE32(&head[0]) == SIDECAR_MAGIC) &&
+            (readLE32(&head[4]) == (uint32_t)bmpFile.size()) &&
+            (readLE32(&head[8]) == (uint32_t)bmpFile.getLastWrite()) &&
+            (readLE32(&head[12]) == headerHash(bmpFile)) &&
+            (readLE16(&head[16]) == img->w) &&
+            (readLE16(&head[18]) == img->h) && readRaw(file, img);
+  file.close();
+  if (!ok)
+  {
+    img->dealloc(); // Keeps w and h for decoding the BMP
+    return false;
+  }
+  img->compression = compression;
+  for (uint8_t i = 0; i < img->numStrips(); i++)
+    img->finishStrip(i);
+  return true;
+}
+
+/*!
+    @brief   Write the sidecar for a freshly decoded image. Failure (flash
+             full, name too long) is not an error for the load; a partly
+             written sidecar is removed.
+    @param   bmpFile
+             The BMP file, open; its size, modification time and header
+             hash are recorded.
+    @param   filename
+             Name of the BMP file.
+    @param   img
+             Image just decoded, strips still uncompressed.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::writeSidecar(File &bmpFile, const char *filename,
+                                      const SPIFFS_Image *img)
+{
+  char name[SIDECAR_NAME];
+  uint8_t head[SIDECAR_HEADER];
+  File file;
+
+  if (!sidecarName(filename, name) ||
+      !(file = filesys->open(name, FILE_WRITE)))
+    return;
+
+  writeLE32(&head[0], SIDECAR_MAGIC);
+  writeLE32(&head[4], bmpFile.size());
+  writeLE32(&head[8], bmpFile.getLastWrite());
+  writeLE32(&head[12], headerHash(bmpFile));
+  writeLE16(&head[16], img->w);
+  writeLE16(&head[18], img->h);
+  bool ok = file.write(head, sizeof head) == sizeof head;
+  for (uint8_t i = 0; ok && i < img->numStrips(); i++)
+  {
+    size_t bytes = (size_t)img->w * img->stripHeight(i) * 2;
+    ok = file.write((const uint8_t *)img->canvas[i]->getBuffer(), bytes) ==
+         bytes;
+  }
+  file.close();
+  if (!ok)
+    filesys->remove(name);
+}
+
+/*!
+    @brief   Load a palette BMP as an indexed image plus a 565 palette,
+             recolorable with SPIFFS_Image::setPalette(): 1-bit files
+             (icons, masks) as IMAGE_1 with one bit per pixel, 1/16 of the
+             RAM of RGB565; 4 and 8-bit files (indexed or gray) as IMAGE_8
+             with one byte per pixel, half the RAM. Compression set with
+             setCompression() doesn't apply.
+    @param   file
+             Open BMP file, header already read.
+    @param   hdr
+             Decoded header of that file.
+    @param   img
+             Image to load, empty.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure; image partly allocated,
+             caller deallocates).
+*/
+ImageReturnCode SPIFFS_ImageReader::loadIndexed(File &file,
+                                                const SPIFFS_BMPHeader &hdr,
+                                                SPIFFS_Image *img)
+{
+  if ((hdr.planes != 1) || (hdr.compression != 0) ||
+      (hdr.colors > (1UL << hdr.depth)) || (hdr.width <= 0) ||
+      (hdr.width > MAX_WIDTH) || (hdr.height <= 0) ||
+      (hdr.height > NUM_CANVAS * CANVAS_HEIGHT))
+    return IMAGE_ERR_FORMAT;
+  img->w = hdr.width;
+  img->h = hdr.height;
+  if (!img->allocIndexed(hdr.depth))
+    return IMAGE_ERR_MALLOC;
+
+  uint32_t sdbuf[SDBUF_WORDS];
+  uint16_t bufSize;
+  uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+  bool ok = readPalette(file, hdr, img->palette, buf, bufSize) &&
+            decodeIndexed(file, hdr, img->canvas8, img->canvas1, buf, bufSize);
+  if (buf != (uint8_t *)sdbuf)
+    free(buf);
+  if (!ok)
+    return IMAGE_ERR_FORMAT; // Truncated file
+  for (uint8_t i = 0; i < img->numStrips(); i++)
+    img->finishStrip(i);
+  return IMAGE_SUCCESS;
+}
+
+/*!
+    @brief   BMP-reading function common both to the draw function (to TFT)
+             and load function (to canvas object in RAM). BMP code has been
+             centralized here so if/when more BMP format variants are added
+             in the future, it doesn't need to be implemented, debugged and
+             kept in sync in two places. Uncompressed 16 (X1R5G5B5), 24
+             and 32 bit images are handled, either row order; 1, 4 and
+             8-bit palette images are kept indexed (see loadIndexed()).
+    @param   filename
+             Name of BMP image file to load.
+    @param   tft
+             Pointer to TFT object, if loading to screen, else NULL.
+    @param   dest
+             Working buffer for loading 16-bit TFT pixel data, if loading to
+             screen, else NULL.
+    @param   x
+             Horizontal offset in pixels (if loading to screen).
+    @param   y
+             Vertical offset in pixels (if loading to screen).
+    @param   img
+             Pointer to SPIFFS_Image object, if loading to RAM (or NULL
+             if loading to screen).
+    @param   transact
+             Use SPI transactions; 'true' is needed only if loading to screen
+             and it's on the same SPI bus as the SD card. Other situations
+             can use 'false'.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::coreBMP(
+    char *filename, // SD file to load
+    SPIFFS_Image *img)
+{
+  ImageReturnCode status = IMAGE_ERR_FORMAT; // IMAGE_SUCCESS on valid file
+  File file;                                 // Per-call, keeps us reentrant
+  SPIFFS_BMPHeader hdr;                      // Decoded BMP header
+  DecodeKernel kernel;                       // Row decoder for this format
+  uint32_t sdbuf[SDBUF_WORDS];               // BMP read buf (R+G+B/pixel)
+
+  // If an SPIFFS_Image object is passed and currently contains anything,
+  // free its contents as it's about to be overwritten with new stuff.
+  img->dealloc();
+
+  // Open requested file on SD card
+  if (!(file = filesys->open(filename, FILE_READ)))
+  {
+    return IMAGE_ERR_FILE_NOT_FOUND;
+  }
+
+  bool valid = readHeader(file, hdr) == IMAGE_SUCCESS;
+  if (valid && ((hdr.depth == 1) || (hdr.depth == 4) || (hdr.depth == 8)))
+  { // Palette image, kept as indices
+    if ((status = loadIndexed(file, hdr, img)) != IMAGE_SUCCESS)
+      img->dealloc();
+  }
+  else if (valid && (kernel = selectKernel(hdr)))
+  {
+    img->w = hdr.width;
+    img->h = hdr.height;
+
+    // Loading to RAM -- allocate GFX 16-bit canvas type
+    status = IMAGE_ERR_MALLOC; // Assume won't fit to start
+    if (sidecar && loadSidecar(file, filename, img))
+    {
+      file.close();
+      return IMAGE_SUCCESS;
+    }
+
+    if (img->allocStrips())
+    { // Supported format, alloc OK, etc.
+      // Split scanlines into bands; band 0 stays on this task and uses
+      // the file that's already open, the rest get workers of their own.
+      int32_t perBand = (hdr.height + bands - 1) / bands;
+      uint8_t numBands = (hdr.height + perBand - 1) / perBand;
+      DecodeBand band[MAX_BANDS];
+      for (uint8_t i = 1; i < numBands; i++)
+      {
+        band[i].filesys = filesys;
+        band[i].filename = filename;
+        band[i].hdr = &hdr;
+        band[i].kernel = kernel;
+        band[i].canvas = img->canvas;
+        band[i].first = i * perBand;
+        band[i].count = hdr.height - band[i].first;
+        if (band[i].count > perBand)
+          band[i].count = perBand;
+        startBand(band[i]);
+      }
+      uint16_t bufSize;
+      uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+      bool ok = kernel(file, hdr, img->canvas, 0, perBand, buf, bufSize);
+      if (buf != (uint8_t *)sdbuf)
+        free(buf);
+      for (uint8_t i = 1; i < numBands; i++)
+        ok &= joinBand(band[i]);
+      if (ok)
+      {
+        if (sidecar)
+          writeSidecar(file, filename, img);
+        img->compression = compression;
+        for (uint8_t i = 0; i < img->numStrips(); i++)
+          img->finishStrip(i);
+      }
+      status = ok ? IMAGE_SUCCESS : IMAGE_ERR_FORMAT; // Else truncated file
+    }
+    if (status != IMAGE_SUCCESS)
+      img->dealloc();
+  }
+
+  file.close();
+  return status;
+}
+
+/*!
+    @brief   Opens a BMP image file for lazy loading: only the header is
+             read now, and each strip of the image is decoded the first
+             time draw() puts it on screen. Tall images open instantly and
+             only the parts actually shown take RAM; releaseStrips() hands
+             that RAM back. The file must stay in place while the image is
+             in use. Compression set with setCompression() applies to
+             strips as they are loaded.
+    @param   filename
+             Name of BMP image file to open.
+    @param   img
+             SPIFFS_Image object, contents will be initialized on success
+             (else cleared).
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::openBMP(char *filename,
+                                            SPIFFS_Image &img)
+{
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  File file;
+  SPIFFS_BMPHeader hdr;
+
+  img.dealloc();
+  if (!(file = filesys->open(filename, FILE_READ)))
+    return IMAGE_ERR_FILE_NOT_FOUND;
+
+  if ((readHeader(file, hdr) == IMAGE_SUCCESS) && selectKernel(hdr))
+  {
+    if ((img.path = strdup(filename)))
+    {
+      img.filesys = filesys;
+      img.bmp = hdr;
+      img.w = hdr.width;
+      img.h = hdr.height;
+      img.compression = compression;
+      img.format = IMAGE_16;
+      img.link(); // Strips may be reclaimed under memory pressure
+      status = IMAGE_SUCCESS;
+    }
+    else
+    {
+      status = IMAGE_ERR_MALLOC;
+    }
+  }
+
+  file.close();
+  return status;
+}
+
+// PYRAMID FILES **********************************************************
+// One image at several scales, see savePyramid() and loadPyramid().
+
+/*!
+    @brief   Save a loaded image as a pyramid file: the image at full, 1/2,
+             1/4 and 1/8 size (each level box-filtered from the full
+             image) with a table of where each level starts. loadPyramid()
+             then reads only the level it needs, so thumbnails and list
+             views load a small fraction of the full image's data. Meant
+             to be run once per asset, e.g. at first boot or by an
+             installer sketch.
+    @param   filename
+             Name of pyramid file to write (replaced if it exists).
+    @param   img
+             Image loaded with loadBMP() or opened with openBMP().
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure). IMAGE_ERR_FORMAT if the
+             image is empty, IMAGE_ERR_FILE_NOT_FOUND if the file could not
+             be written.
+*/
+ImageReturnCode SPIFFS_ImageReader::savePyramid(char *filename,
+                                                SPIFFS_Image &img)
+{
+  if (img.getFormat() == IMAGE_NONE)
+    return IMAGE_ERR_FORMAT;
+
+  // Level table
+  uint8_t head[PYRAMID_HEADER];
+  uint32_t offset = PYRAMID_HEADER;
+  writeLE32(&head[0], PYRAMID_MAGIC);
+  writeLE16(&head[4], PYRAMID_LEVELS);
+  writeLE16(&head[6], 0);
+  for (uint8_t n = 0; n < PYRAMID_LEVELS; n++)
+  {
+    uint16_t lw = (img.w + (1 << n) - 1) >> n; // Partial blocks round up
+    uint16_t lh = (img.h + (1 << n) - 1) >> n;
+    writeLE16(&head[8 + n * 8], lw);
+    writeLE16(&head[10 + n * 8], lh);
+    writeLE32(&head[12 + n * 8], offset);
+    offset += (uint32_t)lw * lh * 2;
+  }
+
+  // Per-column channel sums of one output row and the row itself. At most
+  // 8x8 pixels of 6 bits go into a sum, so 16 bits are plenty.
+  uint16_t *sums = (uint16_t *)malloc(img.w * 3 * sizeof(uint16_t));
+  uint16_t *out = (uint16_t *)malloc(img.w * sizeof(uint16_t));
+  uint16_t *scratch = (uint16_t *)malloc(img.scratchPixels() * 2);
+  File file;
+  if (!sums || !out || !scratch)
+  {
+    free(sums);
+    free(out);
+    free(scratch);
+    return IMAGE_ERR_MALLOC;
+  }
+  if (!(file = filesys->open(filename, FILE_WRITE)))
+  {
+    free(sums);
+    free(out);
+    free(scratch);
+    return IMAGE_ERR_FILE_NOT_FOUND;
+  }
+
+  SPIFFS_Image::BusyScope pin(img);
+  bool ok = file.write(head, sizeof head) == sizeof head;
+  for (uint8_t n = 0; ok && n < PYRAMID_LEVELS; n++)
+  {
+    uint8_t cached = 0xFF;
+    uint16_t lw = readLE16(&head[8 + n * 8]);
+    for (uint16_t y = 0; ok && y < img.h; y++)
+    {
+      const uint16_t *px = img.rowPixels(y, scratch, cached);
+      if (px == NULL)
+      {
+        ok = false;
+      }
+      else if (n == 0)
+      { // Full size, rows go out as they are
+        ok = file.write((const uint8_t *)px, img.w * 2) == img.w * 2u;
+      }
+      else
+      {
+        if ((y & ((1 << n) - 1)) == 0)
+          memset(sums, 0, lw * 3 * sizeof(uint16_t));
+        for (uint16_t x = 0; x < img.w; x++)
+        {
+          uint16_t *sum = &sums[(x >> n) * 3];
+          sum[0] += px[x] >> 11;
+          sum[1] += (px[x] >> 5) & 0x3F;
+          sum[2] += px[x] & 0x1F;
+        }
+        uint16_t rows = (y & ((1 << n) - 1)) + 1;
+        if ((rows == (1 << n)) || (y == img.h - 1))
+        { // Block row complete, average and write it
+          for (uint16_t x = 0; x < lw; x++)
+          {
+            uint16_t cols = img.w - (x << n);
+            if (cols > (1 << n))
+              cols = 1 << n;
+            uint16_t count = cols * rows;
+            uint16_t *sum = &sums[x * 3];
+            out[x] = ((sum[0] + count / 2) / count << 11) |
+                     ((sum[1] + count / 2) / count << 5) |
+                     ((sum[2] + count / 2) / count);
+          }
+          ok = file.write((const uint8_t *)out, lw * 2) == lw * 2u;
+        }
+      }
+    }
+  }
+  file.close();
+  free(sums);
+  free(out);
+  free(scratch);
+  if (!ok)
+  {
+    filesys->remove(filename);
+    return IMAGE_ERR_FILE_NOT_FOUND;
+  }
+  return IMAGE_SUCCESS;
+}
+
+/*!
+    @brief   Load one level of a pyramid file written by savePyramid(): the
+             largest that fits within the requested size, or the smallest
+             level if none does. Only that level's pixels are read.
+             Compression set with setCompression() applies.
+    @param   filename
+             Name of pyramid file to load.
+    @param   img
+             SPIFFS_Image object, contents will be initialized, allocated
+             and loaded on success (else cleared).
+    @param   maxWidth
+             Largest acceptable width in pixels.
+    @param   maxHeight
+             Largest acceptable height in pixels.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::loadPyramid(char *filename,
+                                                SPIFFS_Image &img,
+                                                int16_t maxWidth,
+                                                int16_t maxHeight)
+{
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  uint8_t head[PYRAMID_HEADER];
+  File file;
+
+  img.dealloc();
+  if (!(file = filesys->open(filename, FILE_READ)))
+    return IMAGE_ERR_FILE_NOT_FOUND;
+
+  uint16_t levels = 0;
+  if ((file.read(head, sizeof head) == sizeof head) &&
+      (readLE32(&head[0]) == PYRAMID_MAGIC))
+    levels = readLE16(&head[4]);
+  if ((levels > 0) && (levels <= PYRAMID_LEVELS))
+  {
+    uint8_t n = 0; // Levels shrink, take the first that fits
+    while ((n < levels - 1) &&
+           ((readLE16(&head[8 + n * 8]) > maxWidth) ||
+            (readLE16(&head[10 + n * 8]) > maxHeight)))
+      n++;
+    img.w = readLE16(&head[8 + n * 8]);
+    img.h = readLE16(&head[10 + n * 8]);
+    if ((img.w > 0) && (img.h > 0) &&
+        (img.h <= NUM_CANVAS * CANVAS_HEIGHT) &&
+        file.seek(readLE32(&head[12 + n * 8])))
+    {
+      if (readRaw(file, &img))
+      {
+        img.compression = compression;
+        for (uint8_t i = 0; i < img.numStrips(); i++)
+          img.finishStrip(i);
+        status = IMAGE_SUCCESS;
+      }
+      else
+      {
+        status = IMAGE_ERR_MALLOC; // Or truncated file
+      }
+    }
+  }
+  if (status != IMAGE_SUCCESS)
+    img.dealloc();
+
+  file.close();
+  return status;
+}
+
+// INTERLACED FILES *******************************************************
+// Coarse-to-fine drawing, see saveInterlaced() and drawProgressive().
+
+/// First row, row step and drawn height of each interlace pass
+static const uint8_t interlacePass[INTERLACE_PASSES][3] = {
+    {0, 8, 8}, {4, 8, 4}, {2, 4, 2}, {1, 2, 1}};
+
+/*!
+    @brief   Save a loaded image as an interlaced file for
+             drawProgressive(): its rows are stored in four passes (every
+             8th row, then every 8th offset by 4, every 4th offset by 2,
+             then the odd rows) so that each pass is one contiguous read.
+    @param   filename
+             Name of interlaced file to write (replaced if it exists).
+    @param   img
+             Image loaded with loadBMP() or opened with openBMP().
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure). IMAGE_ERR_FORMAT if the
+             image is empty, IMAGE_ERR_FILE_NOT_FOUND if the file could not
+             be written.
+*/
+ImageReturnCode SPIFFS_ImageReader::saveInterlaced(char *filename,
+                                                   SPIFFS_Image &img)
+{
+  if (img.getFormat() == IMAGE_NONE)
+    return IMAGE_ERR_FORMAT;
+
+  uint8_t head[INTERLACE_HEADER];
+  uint16_t *scratch = (uint16_t *)malloc(img.scratchPixels() * 2);
+  File file;
+  if (!scratch)
+    return IMAGE_ERR_MALLOC;
+  if (!(file = filesys->open(filename, FILE_WRITE)))
+  {
+    free(scratch);
+    return IMAGE_ERR_FILE_NOT_FOUND;
+  }
+
+  SPIFFS_Image::BusyScope pin(img);
+  writeLE32(&head[0], INTERLACE_MAGIC);
+  writeLE16(&head[4], img.w);
+  writeLE16(&head[6], img.h);
+  bool ok = file.write(head, sizeof head) == sizeof head;
+  uint8_t cached = 0xFF;
+  for (uint8_t p = 0; ok && p < INTERLACE_PASSES; p++)
+  {
+    for (uint16_t row = interlacePass[p][0]; ok && row < img.h;
+         row += interlacePass[p][1])
+    {
+      const uint16_t *px = img.rowPixels(row, scratch, cached);
+      ok = px && (file.write((const uint8_t *)px, img.w * 2) == img.w * 2u);
+    }
+  }
+  file.close();
+  free(scratch);
+  if (!ok)
+  {
+    filesys->remove(filename);
+    return IMAGE_ERR_FILE_NOT_FOUND;
+  }
+  return IMAGE_SUCCESS;
+}
+
+/*!
+    @brief   Draws an interlaced file written by saveInterlaced() straight
+             to the screen, coarse first: the first pass (every 8th row,
+             each drawn 8 rows tall) gives a blocky preview of the whole
+             image after an eighth of the data, and each further pass
+             halves the block height until every row is in place. The
+             total amount read is the same as for the plain image, in
+             READ_BLOCK sized reads.
+    @param   filename
+             Name of interlaced file to draw.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the screen edges. Screen rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::drawProgressive(char *filename,
+                                                    Adafruit_SPITFT &tft,
+                                                    int16_t x, int16_t y)
+{
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  uint8_t head[INTERLACE_HEADER];
+  File file;
+
+  if (!(file = filesys->open(filename, FILE_READ)))
+    return IMAGE_ERR_FILE_NOT_FOUND;
+
+  if ((file.read(head, sizeof head) == sizeof head) &&
+      (readLE32(&head[0]) == INTERLACE_MAGIC))
+  {
+    uint16_t w = readLE16(&head[4]), h = readLE16(&head[6]);
+    uint32_t rowBytes = (uint32_t)w * 2;
+    uint32_t bufSize = (rowBytes > READ_BLOCK) ? rowBytes : READ_BLOCK;
+    uint16_t *buf = (uint16_t *)malloc(bufSize);
+    if ((w == 0) || (h == 0))
+    {
+      status = IMAGE_ERR_FORMAT;
+    }
+    else if (buf == NULL)
+    {
+      status = IMAGE_ERR_MALLOC;
+    }
+    else
+    {
+      uint16_t rowsPerRead = bufSize / rowBytes;
+      status = IMAGE_SUCCESS;
+      for (uint8_t p = 0; (status == IMAGE_SUCCESS) && (p < INTERLACE_PASSES);
+           p++)
+      {
+        uint16_t step = interlacePass[p][1];
+        uint16_t tall = interlacePass[p][2];
+        uint16_t row = interlacePass[p][0];
+        while (row < h)
+        { // Fetch as many of this pass's rows as fit with one read call
+          uint16_t rows = (h - row + step - 1) / step;
+          if (rows > rowsPerRead)
+            rows = rowsPerRead;
+          if (file.read((uint8_t *)buf, rows * rowBytes) != rows * rowBytes)
+          {
+            status = IMAGE_ERR_FORMAT; // Truncated file
+            break;
+          }
+          for (uint16_t r = 0; r < rows; r++, row += step)
+          { // Stretch the row down over the rows later passes fill in
+            uint16_t n = (row + tall > h) ? h - row : tall;
+            drawBlock(tft, x, y + row, w, n, &buf[r * w]);
+          }
+          yield(); // Keep ESP8266 happy
+        }
+      }
+    }
+    free(buf);
+  }
+
+  file.close();
+  return status;
+}
+
+// STREAMING **************************************************************
+// Drawing straight from file to screen, one strip's worth of rows at a
+// time, without loading the image. Strips are decoded in file order
+// (bottom strip first for normal bottom-to-top BMPs) so the file is read
+// front to back without seeking around; the screen doesn't mind the order.
+
+/*!
+    @brief   Draws BMP image file from flash straight to the screen,
+             without loading it to RAM first. Only one strip of
+             CANVAS_HEIGHT rows is held in RAM at a time, so the image
+             may be taller than loadBMP() allows.
+    @param   filename
+             Name of BMP image file to draw.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Horizontal offset in pixels; left edge = 0, positive = right.
+             Value is signed, image will be clipped if all or part is off
+             the screen edges. Screen rotation setting is observed.
+    @param   y
+             Vertical offset in pixels; top edge = 0, positive = down.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::drawBMP(char *filename,
+                                            Adafruit_SPITFT &tft, int16_t x,
+                                            int16_t y)
+{
+  uint32_t sdbuf[SDBUF_WORDS];
+  uint16_t bufSize;
+  uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+  GFXcanvas16 *band = NULL;
+  ImageReturnCode status =
+      streamBMP(filename, tft, x, y, 0, 0, band, buf, bufSize);
+  delete band;
+  if (buf != (uint8_t *)sdbuf)
+    free(buf);
+  return status;
+}
+
+/*!
+    @brief   Draws a grid of BMP images, e.g. the thumbnails of a gallery
+             screen, streaming each straight to its cell. One strip buffer
+             and one read buffer are shared by all images (the strip
+             buffer grows to the widest image), so the whole grid needs
+             about as much RAM as a single drawBMP() and none of the
+             allocate/load/free cycle of loadBMP() per image. Each file is
+             opened once and read front to back. Images smaller than a
+             cell are centered in it, larger ones are clipped to it.
+    @param   filenames
+             Array of BMP image file names, drawn left to right, top to
+             bottom.
+    @param   count
+             Number of file names.
+    @param   tft
+             Screen to draw to (any Adafruit_SPITFT-derived class).
+    @param   x
+             Left edge of the grid in pixels.
+    @param   y
+             Top edge of the grid in pixels.
+    @param   cellWidth
+             Width of each grid cell in pixels.
+    @param   cellHeight
+             Height of each grid cell in pixels.
+    @param   columns
+             Number of cells per grid row.
+    @return  IMAGE_SUCCESS if every image was drawn, else the
+             ImageReturnCode of the last one that failed (the others are
+             still drawn).
 */
-SPIFFS_Image::SPIFFS_Image(void)
-    : format(IMAGE_NONE)
+ImageReturnCode SPIFFS_ImageReader::drawGrid(char **filenames, uint8_t count,
+                                             Adafruit_SPITFT &tft, int16_t x,
+                                             int16_t y, int16_t cellWidth,
+                                             int16_t cellHeight,
+                                             uint8_t columns)
 {
-  for (int i = 0; i < NUM_CANVAS; i++)
-    canvas[i] = NULL;
+  if ((cellWidth <= 0) || (cellHeight <= 0) || (columns == 0))
+    return IMAGE_ERR_FORMAT;
+
+  uint32_t sdbuf[SDBUF_WORDS];
+  uint16_t bufSize;
+  uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+  GFXcanvas16 *band = NULL;
+  ImageReturnCode status = IMAGE_SUCCESS;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    ImageReturnCode s = streamBMP(filenames[i], tft,
+                                  x + (i % columns) * cellWidth,
+                                  y + (i / columns) * cellHeight, cellWidth,
+                                  cellHeight, band, buf, bufSize);
+    if (s != IMAGE_SUCCESS)
+      status = s;
+  }
+  delete band;
+  if (buf != (uint8_t *)sdbuf)
+    free(buf);
+  return status;
 }
 
 /*!
-    @brief   Destructor.
+    @brief   Draw one BMP file straight to the screen, optionally centered
+             in and clipped to a cell.
+    @param   filename
+             Name of BMP image file to draw.
+    @param   tft
+             Screen to draw to.
+    @param   x
+             Left edge of image (or cell) in pixels.
+    @param   y
+             Top edge of image (or cell) in pixels.
+    @param   cellWidth
+             Cell width in pixels, 0 for no cell.
+    @param   cellHeight
+             Cell height in pixels, 0 for no cell.
+    @param   band
+             Strip canvas shared between calls, NULL at first; replaced
+             by a wider one if the image needs it. Caller deletes it.
+    @param   buf
+             Working buffer for raw BMP data.
+    @param   bufSize
+             Size of buf in bytes.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure).
+*/
+ImageReturnCode SPIFFS_ImageReader::streamBMP(
+    char *filename, Adafruit_SPITFT &tft, int16_t x, int16_t y,
+    int16_t cellWidth, int16_t cellHeight, GFXcanvas16 *&band, uint8_t *buf,
+    uint16_t bufSize)
+{
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  File file;
+  SPIFFS_BMPHeader hdr;
+  DecodeKernel kernel;
+
+  if (!(file = filesys->open(filename, FILE_READ)))
+    return IMAGE_ERR_FILE_NOT_FOUND;
+
+  if ((readHeader(file, hdr) == IMAGE_SUCCESS) && (kernel = formatKernel(hdr)))
+  {
+    // Visible part of the image, in image coordinates
+    int16_t visW = hdr.width, visH = hdr.height;
+    if (cellWidth > 0)
+    {
+      if (visW < cellWidth)
+        x += (cellWidth - visW) / 2;
+      else
+        visW = cellWidth;
+      if (visH < cellHeight)
+        y += (cellHeight - visH) / 2;
+      else
+        visH = cellHeight;
+    }
+    if (y + visH > tft.height())
+      visH = tft.height() - y;
+    int16_t visTop = (y < 0) ? -y : 0;
+
+    if (band && (band->width() < hdr.width))
+    {
+      delete band;
+      band = NULL;
+    }
+    if (!band && (!(band = new GFXcanvas16(hdr.width, CANVAS_HEIGHT)) ||
+                  !band->getBuffer()))
+    {
+      delete band;
+      band = NULL;
+      status = IMAGE_ERR_MALLOC;
+    }
+    else
+    {
+      // Every strip decodes into the same canvas as an image of its own,
+      // one strip tall, so the image height isn't limited by NUM_CANVAS.
+      // Rows are addressed with the image's own width as stride, so a
+      // wider canvas is fine.
+      const uint32_t rowSize = ((hdr.depth * hdr.width + 31) / 32) * 4;
+      SPIFFS_BMPHeader strip = hdr;
+      int32_t numStrips = (hdr.height + CANVAS_HEIGHT - 1) / CANVAS_HEIGHT;
+      status = IMAGE_SUCCESS;
+      for (int32_t n = 0; (status == IMAGE_SUCCESS) && (n < numStrips); n++)
+      {
+        int32_t i = hdr.flip ? (numStrips - 1 - n) : n; // File order
+        int32_t top = i * CANVAS_HEIGHT;
+        int32_t sh = hdr.height - top;
+        if (sh > CANVAS_HEIGHT)
+          sh = CANVAS_HEIGHT;
+        if (top >= visH)
+        {
+          if (hdr.flip)
+            continue; // Clipped by cell or screen, visible rows follow
+          break;      // Nothing further down is visible
+        }
+        if (top + sh <= visTop)
+          continue; // Clipped by cell or screen
+        int32_t first = hdr.flip ? (hdr.height - top - sh) : top;
+        strip.offset = hdr.offset + first * rowSize;
+        strip.height = sh;
+        if (!kernel(file, strip, &band, 0, sh, buf, bufSize))
+        {
+          status = IMAGE_ERR_FORMAT; // Truncated file
+          break;
+        }
+        if (top + sh > visH)
+          sh = visH - top;
+        uint16_t *px = band->getBuffer();
+        if (visW == hdr.width)
+        { // Whole rows, the strip goes out as one bitmap
+          tft.drawRGBBitmap(x, y + top, px, visW, sh);
+        }
+        else
+        {
+          for (int16_t r = 0; r < sh; r++)
+            tft.drawRGBBitmap(x, y + top + r, &px[r * hdr.width], visW, 1);
+        }
+      }
+    }
+  }
+
+  file.close();
+  return status;
+}
+
+// NATIVE OUTPUT **********************************************************
+// loadNative() converts BMP pixels once, while decoding, into the byte
+// layout a panel takes over the wire, so drawing becomes a plain transfer
+// with no per-pixel work. Rows come from scanRows(), like every other
+// decode; the sink, picked once per file, converts and stores them.
+
+/*!
+    @brief   Fetch one BMP pixel as 8-bit channels.
+    @param   src
+             Pixel data, BPP bytes (X1R5G5B5, BGR or BGRX).
+    @param   r
+             Red, returned.
+    @param   g
+             Green, returned.
+    @param   b
+             Blue, returned.
     @return  None (void).
 */
-SPIFFS_Image::~SPIFFS_Image(void) { dealloc(); }
+template <uint8_t BPP>
+static inline void fetchRGB(const uint8_t *src, uint8_t &r, uint8_t &g,
+                            uint8_t &b)
+{
+  if (BPP == 2)
+  { // 5-bit channels, top bits replicated into the new low bits
+    uint16_t p = src[0] | (src[1] << 8);
+    r = ((p >> 7) & 0xF8) | ((p >> 12) & 0x07);
+    g = ((p >> 2) & 0xF8) | ((p >> 7) & 0x07);
+    b = ((p << 3) & 0xF8) | ((p >> 2) & 0x07);
+  }
+  else
+  {
+    b = src[0];
+    g = src[1];
+    r = src[2];
+  }
+}
+
+/// Destination of nativeSink()
+struct NativeDest
+{
+  uint8_t *data;     ///< Output, row 0 first
+  uint32_t rowBytes; ///< Bytes per output row
+};
 
 /*!
-    @brief   Deallocates memory associated with SPIFFS_Image object
-             and resets member variables to 'empty' state.
+    @brief   Row sink storing pixels in a panel's native layout, one
+             specialisation per source depth and output format.
+    @param   ctx
+             NativeDest to write to.
+    @param   src
+             BMP pixel data, BPP bytes per pixel.
+    @param   row
+             Image row, 0 = top.
+    @param   x
+             Column of the first pixel.
+    @param   n
+             Number of pixels.
     @return  None (void).
 */
-void SPIFFS_Image::dealloc(void)
+template <uint8_t BPP, uint8_t FMT>
+static void nativeSink(void *ctx, const uint8_t *src, int32_t row, uint16_t x,
+                       uint16_t n)
 {
-  for (int i = 0; i < NUM_CANVAS; i++)
+  NativeDest *nd = (NativeDest *)ctx;
+  uint8_t *dest = nd->data + row * nd->rowBytes;
+  if (((FMT == PIXEL_GRAY2) || (FMT == PIXEL_MONO)) && (x == 0))
+    memset(dest, 0, nd->rowBytes); // Packed pixels are OR'ed in
+  for (uint16_t end = x + n; x < end; x++, src += BPP)
   {
-    if (canvas[i] != NULL)
+    uint8_t r, g, b;
+    fetchRGB<BPP>(src, r, g, b);
+    if ((FMT == PIXEL_RGB565) || (FMT == PIXEL_BGR565))
     {
-      delete canvas[i];
-      canvas[i] = NULL;
+      if (FMT == PIXEL_BGR565)
+      {
+        uint8_t t = r;
+        r = b;
+        b = t;
+      }
+      dest[x * 2] = (r & 0xF8) | (g >> 5);
+      dest[x * 2 + 1] = ((g & 0x1C) << 3) | (b >> 3);
+    }
+    else if (FMT == PIXEL_RGB666)
+    {
+      dest[x * 3] = r & 0xFC;
+      dest[x * 3 + 1] = g & 0xFC;
+      dest[x * 3 + 2] = b & 0xFC;
+    }
+    else
+    { // Luma with weights 77/150/29 of 256
+      uint8_t y = (r * 77 + g * 150 + b * 29) >> 8;
+      if (FMT == PIXEL_GRAY2)
+        dest[x >> 2] |= (y >> 6) << (6 - 2 * (x & 3));
+      else if (y & 0x80)
+        dest[x >> 3] |= 0x80 >> (x & 7);
     }
   }
-  format = IMAGE_NONE;
 }
 
 /*!
-    @brief   Get width of SPIFFS_Image object.
-    @return  Width in pixels, or 0 if no image loaded.
+    @brief   Get the native row sinks of one output format.
+    @return  Table of three sinks, for 16, 24 and 32-bit sources.
 */
-int16_t SPIFFS_Image::width(void) const
+template <uint8_t FMT> static const RowSink *nativeSinks(void)
 {
-  if (format != IMAGE_NONE)
-  { // Image allocated?
-    if (format == IMAGE_16)
-      return w;
-  }
-  return 0;
+  static const RowSink sinks[3] = {nativeSink<2, FMT>, nativeSink<3, FMT>,
+                                   nativeSink<4, FMT>};
+  return sinks;
 }
 
 /*!
-    @brief   Get height of SPIFFS_Image object.
-    @return  Height in pixels, or 0 if no image loaded.
+    @brief   Get the size of one row of loadNative() output.
+    @param   fmt
+             Output format.
+    @param   width
+             Image width in pixels.
+    @return  Bytes per row; packed formats start each row on a new byte.
 */
-int16_t SPIFFS_Image::height(void) const
+uint32_t SPIFFS_ImageReader::nativeRowBytes(PixelFormat fmt, int32_t width)
 {
-  if (format != IMAGE_NONE)
-  { // Image allocated?
-    if (format == IMAGE_16)
-      return h;
+  switch (fmt)
+  {
+  case PIXEL_RGB565:
+  case PIXEL_BGR565:
+    return (uint32_t)width * 2;
+  case PIXEL_RGB666:
+    return (uint32_t)width * 3;
+  case PIXEL_GRAY2:
+    return (width + 3) / 4;
+  default:
+    return (width + 7) / 8;
   }
-  return 0;
 }
 
 /*!
-    @brief   Draw image to an Adafruit_SPITFT-type display.
-    @param   tft
-             Screen to draw to (any Adafruit_SPITFT-derived class).
-    @param   x
-             Horizontal offset in pixels; left edge = 0, positive = right.
-             Value is signed, image will be clipped if all or part is off
-             the screen edges. Screen rotation setting is observed.
-    @param   y
-             Vertical offset in pixels; top edge = 0, positive = down.
-    @return  None (void).
+    @brief   Loads a BMP image file into a caller-provided buffer in a
+             panel's native pixel format, converting each pixel once while
+             decoding rather than on every draw. Rows are stored top first,
+             nativeRowBytes() apart, ready to be sent as they are: e.g.
+             PIXEL_RGB565 with tft.writePixels(buf, len, true, true) after
+             setAddrWindow() (no byte swapping), PIXEL_RGB666 to an
+             ILI9488 or PIXEL_MONO / PIXEL_GRAY2 to an e-paper or OLED
+             controller with the driver's bulk write. Uncompressed 16, 24
+             and 32-bit BMPs up to MAX_WIDTH wide are handled; height isn't
+             limited by NUM_CANVAS.
+    @param   filename
+             Name of BMP image file to load.
+    @param   fmt
+             Output pixel format.
+    @param   dest
+             Output buffer, at least nativeRowBytes(fmt, width) * height
+             bytes (see bmpDimensions()).
+    @param   size
+             Size of dest in bytes.
+    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
+             completion, other values on failure). IMAGE_ERR_MALLOC if dest
+             is too small.
 */
-void SPIFFS_Image::draw(Adafruit_SPITFT &tft, int16_t x, int16_t y)
+ImageReturnCode SPIFFS_ImageReader::loadNative(char *filename, PixelFormat fmt,
+                                               uint8_t *dest, uint32_t size)
 {
-  if (format == IMAGE_16)
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  File file;
+  SPIFFS_BMPHeader hdr;
+
+  if (!(file = filesys->open(filename, FILE_READ)))
+    return IMAGE_ERR_FILE_NOT_FOUND;
+
+  if ((readHeader(file, hdr) == IMAGE_SUCCESS) && (hdr.planes == 1) &&
+      (hdr.compression == 0) && (hdr.width > 0) &&
+      (hdr.width <= MAX_WIDTH) && (hdr.height > 0) &&
+      ((hdr.depth == 16) || (hdr.depth == 24) || (hdr.depth == 32)))
   {
-    for (int i = 0; i < NUM_CANVAS; i++)
+    NativeDest nd = {dest, nativeRowBytes(fmt, hdr.width)};
+    if (size / nd.rowBytes < (uint32_t)hdr.height) // Can't overflow
+    {
+      status = IMAGE_ERR_MALLOC;
+    }
+    else
     {
-      if (canvas[i] != NULL)
+      const RowSink *sinks;
+      switch (fmt)
       {
-        tft.drawRGBBitmap(x, y, canvas[i]->getBuffer(),
-                          canvas[i]->width(), canvas[i]->height());
-        y += CANVAS_HEIGHT;
+      case PIXEL_RGB565:
+        sinks = nativeSinks<PIXEL_RGB565>();
+        break;
+      case PIXEL_BGR565:
+        sinks = nativeSinks<PIXEL_BGR565>();
+        break;
+      case PIXEL_RGB666:
+        sinks = nativeSinks<PIXEL_RGB666>();
+        break;
+      case PIXEL_GRAY2:
+        sinks = nativeSinks<PIXEL_GRAY2>();
+        break;
+      default:
+        sinks = nativeSinks<PIXEL_MONO>();
+        break;
       }
+      uint32_t sdbuf[SDBUF_WORDS];
+      uint16_t bufSize;
+      uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+      if (scanRows(file, hdr, 0, hdr.height, buf, bufSize,
+                   sinks[hdr.depth / 8 - 2], &nd))
+        status = IMAGE_SUCCESS;
+      if (buf != (uint8_t *)sdbuf)
+        free(buf);
     }
   }
+
+  file.close();
+  return status;
 }
 
-// SPIFFS_ImageReader CLASS **********************************************
-// Loads images from SD card to screen or RAM.
+// E-PAPER PLANES *********************************************************
+// loadEPD() decodes straight to the 1-bit planes of a black/white or
+// black/white/red e-paper display, dithering on the way, through the same
+// row sink stage as loadNative().
 
-/*!
-    @brief   Constructor.
-    @return  SPIFFS_ImageReader object.
-    @param   fs
-             FAT filesystem associated with this SPIFFS_ImageReader
-             instance. Any images to load will come from this filesystem;
-             if multiple filesystems are required, each will require its
-             own SPIFFS_ImageReader object. The filesystem does NOT need
-             to be initialized yet when passed in here (since this will
-             often be in pre-setup() declaration, but DOES need initializing
-             before any of the image loading or size functions are called!
-*/
-SPIFFS_ImageReader::SPIFFS_ImageReader() {}
+/// 4x4 Bayer matrix, thresholds of ordered dithering in steps of 16
+static const uint8_t bayer4[4][4] = {
+    {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+
+/// Destination and dither state of epdSink()
+struct EPDDest
+{
+  uint8_t *black;   ///< Black plane, bit set = black ink
+  uint8_t *red;     ///< Red plane, bit set = red ink; NULL if black/white
+  uint16_t stride;  ///< Bytes per plane row
+  int16_t width;    ///< Plane width, pixels beyond are clipped
+  int16_t height;   ///< Plane height, rows beyond are clipped
+  uint8_t channels; ///< 1 (luma) for black/white, 3 (RGB) with red
+  int16_t *err;     ///< Diffusion error of the current scanline, 16ths
+  int16_t *next;    ///< Diffusion error of the following scanline
+};
 
 /*!
-    @brief   Destructor.
+    @brief   Row sink quantizing pixels to e-paper inks, one specialisation
+             per source depth and dither mode. Error diffusion follows file
+             order (usually bottom to top), which looks no different.
+    @param   ctx
+             EPDDest to write to.
+    @param   src
+             BMP pixel data, BPP bytes per pixel.
+    @param   row
+             Image row, 0 = top.
+    @param   x
+             Column of the first pixel.
+    @param   n
+             Number of pixels.
     @return  None (void).
 */
-SPIFFS_ImageReader::~SPIFFS_ImageReader(void)
+template <uint8_t BPP, uint8_t DITHER>
+static void epdSink(void *ctx, const uint8_t *src, int32_t row, uint16_t x,
+                    uint16_t n)
 {
-  if (file)
-    file.close();
-  // filesystem is left as-is
+  EPDDest *ed = (EPDDest *)ctx;
+  const uint8_t ch = ed->channels;
+  if ((DITHER == DITHER_DIFFUSE) && (x == 0))
+  { // New scanline: its error is what the previous one passed down
+    int16_t *t = ed->err;
+    ed->err = ed->next;
+    ed->next = t;
+    memset(ed->next, 0, (ed->width + 2) * ch * sizeof(int16_t));
+  }
+  bool visible = row < ed->height;
+  uint32_t base = (uint32_t)row * ed->stride;
+  for (uint16_t end = x + n; x < end; x++, src += BPP)
+  {
+    uint8_t r, g, b;
+    fetchRGB<BPP>(src, r, g, b);
+    int16_t v[3] = {r, g, b};
+    if (ch == 1)
+      v[0] = (r * 77 + g * 150 + b * 29) >> 8; // Luma
+    for (uint8_t c = 0; c < ch; c++)
+    {
+      if (DITHER == DITHER_ORDERED)
+        v[c] += bayer4[row & 3][x & 3] * 16 + 8 - 128;
+      else if ((DITHER == DITHER_DIFFUSE) && (x < ed->width))
+        v[c] += (ed->err[(x + 1) * ch + c] + 8) >> 4;
+      v[c] = (v[c] < 0) ? 0 : (v[c] > 255) ? 255 : v[c];
+    }
+    // Nearest ink: 0 = white, 1 = black, 2 = red
+    uint8_t ink;
+    if (ch == 1)
+    {
+      ink = (v[0] < 128);
+    }
+    else
+    {
+      int32_t dw = (int32_t)(255 - v[0]) * (255 - v[0]) +
+                   (int32_t)(255 - v[1]) * (255 - v[1]) +
+                   (int32_t)(255 - v[2]) * (255 - v[2]);
+      int32_t dk = (int32_t)v[0] * v[0] + (int32_t)v[1] * v[1] +
+                   (int32_t)v[2] * v[2];
+      int32_t dr = (int32_t)(255 - v[0]) * (255 - v[0]) +
+                   (int32_t)v[1] * v[1] + (int32_t)v[2] * v[2];
+      ink = (dk < dw) ? ((dr < dk) ? 2 : 1) : ((dr < dw) ? 2 : 0);
+    }
+    if ((DITHER == DITHER_DIFFUSE) && (x < ed->width))
+    { // Spread the error 7/16 right, 3/16, 5/16 and 1/16 below
+      for (uint8_t c = 0; c < ch; c++)
+      {
+        int16_t q = ((ink == 0) || ((ink == 2) && (c == 0))) ? 255 : 0;
+        int16_t e = v[c] - q;
+        ed->err[(x + 2) * ch + c] += e * 7;
+        ed->next[x * ch + c] += e * 3;
+        ed->next[(x + 1) * ch + c] += e * 5;
+        ed->next[(x + 2) * ch + c] += e;
+      }
+    }
+    if (visible && (x < ed->width))
+    {
+      uint8_t bit = 0x80 >> (x & 7);
+      uint8_t *k = &ed->black[base + (x >> 3)];
+      *k = (ink == 1) ? (*k | bit) : (*k & ~bit);
+      if (ed->red)
+      {
+        uint8_t *rd = &ed->red[base + (x >> 3)];
+        *rd = (ink == 2) ? (*rd | bit) : (*rd & ~bit);
+      }
+    }
+  }
 }
 
 /*!
-    @brief   Loads BMP image file from SD card into RAM (as one of the GFX
-             canvas object types) for use with the bitmap-drawing functions.
-             Not practical for most AVR microcontrollers, but some of the
-             more capable 32-bit micros can afford some RAM for this.
-    @param   filename
-             Name of BMP image file to load.
-    @param   img
-             SPIFFS_Image object, contents will be initialized, allocated
-             and loaded on success (else cleared).
-    @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
-             completion, other values on failure).
+    @brief   Get the e-paper row sinks of one dither mode.
+    @return  Table of three sinks, for 16, 24 and 32-bit sources.
 */
-ImageReturnCode SPIFFS_ImageReader::loadBMP(char *filename,
-                                            SPIFFS_Image &img)
+template <uint8_t DITHER> static const RowSink *epdSinks(void)
 {
-  // Call core BMP-reading function. TFT and working buffer are NULL
-  // (unused and allocated in function, respectively), X & Y position are
-  // always 0 because full image is loaded (RAM permitting). SPIFFS_Image
-  // argument is passed through, and SPI transactions are not needed when
-  // loading to RAM (bus is not shared during load).
-  return coreBMP(filename, &img);
+  static const RowSink sinks[3] = {epdSink<2, DITHER>, epdSink<3, DITHER>,
+                                   epdSink<4, DITHER>};
+  return sinks;
 }
 
 /*!
-    @brief   BMP-reading function common both to the draw function (to TFT)
-             and load function (to canvas object in RAM). BMP code has been
-             centralized here so if/when more BMP format variants are added
-             in the future, it doesn't need to be implemented, debugged and
-             kept in sync in two places.
+    @brief   Loads a BMP image file straight into the 1-bit planes of an
+             e-paper display, dithered to its inks: black and white, or
+             black, white and red when a red plane is given. Planes take
+             1/16 of the RAM of an RGB565 image, and no per-pixel color
+             matching is left for the panel update. In each GFXcanvas1 a
+             set bit is ink, MSB leftmost, which is the layout of
+             Adafruit_EPD frame buffers (for panel widths that are a
+             multiple of 8): draw the planes with drawBitmap() in
+             EPD_BLACK and EPD_RED, or copy them into the driver's
+             buffers, inverted for planes the driver marks inverted.
+             Uncompressed 16, 24 and 32-bit BMPs are handled.
     @param   filename
              Name of BMP image file to load.
-    @param   tft
-             Pointer to TFT object, if loading to screen, else NULL.
-    @param   dest
-             Working buffer for loading 16-bit TFT pixel data, if loading to
-             screen, else NULL.
-    @param   x
-             Horizontal offset in pixels (if loading to screen).
-    @param   y
-             Vertical offset in pixels (if loading to screen).
-    @param   img
-             Pointer to SPIFFS_Image object, if loading to RAM (or NULL
-             if loading to screen).
-    @param   transact
-             Use SPI transactions; 'true' is needed only if loading to screen
-             and it's on the same SPI bus as the SD card. Other situations
-             can use 'false'.
+    @param   black
+             Black plane, unrotated; the image goes to its top left
+             corner and is clipped to its size. Pixels outside the image
+             are left as they are.
+    @param   red
+             Red plane of the same size, unrotated, or NULL (default) for
+             black/white.
+    @param   dither
+             DITHER_NONE, DITHER_ORDERED or DITHER_DIFFUSE (default).
     @return  One of the ImageReturnCode values (IMAGE_SUCCESS on successful
-             completion, other values on failure).
+             completion, other values on failure). IMAGE_ERR_FORMAT if a
+             plane is rotated or the planes differ in size.
 */
-ImageReturnCode SPIFFS_ImageReader::coreBMP(
-    char *filename, // SD file to load
-    SPIFFS_Image *img)
+ImageReturnCode SPIFFS_ImageReader::loadEPD(char *filename, GFXcanvas1 &black,
+                                            GFXcanvas1 *red,
+                                            ImageDither dither)
 {
+  ImageReturnCode status = IMAGE_ERR_FORMAT;
+  File file;
+  SPIFFS_BMPHeader hdr;
 
-  ImageReturnCode status = IMAGE_ERR_FORMAT; // IMAGE_SUCCESS on valid file
-  uint32_t offset;                           // Start of image data in file
-  uint32_t headerSize;                       // Indicates BMP version
-  int bmpWidth, bmpHeight;                   // BMP width & height in pixels
-  uint8_t planes;                            // BMP planes
-  uint8_t depth;                             // BMP bit depth
-  uint32_t compression = 0;                  // BMP compression mode
-  uint32_t colors = 0;                       // Number of colors in palette
-  uint32_t rowSize;                          // >bmpWidth if scanline padding
-  uint8_t sdbuf[3 * BUFPIXELS];              // BMP read buf (R+G+B/pixel)
-#if ((3 * BUFPIXELS) <= 255)
-  uint8_t srcidx = sizeof sdbuf; // Current position in sdbuf
-#else
-  uint16_t srcidx = sizeof sdbuf;
-#endif
-  uint32_t destidx = 0;
-  boolean flip = true;       // BMP is stored bottom-to-top
-  uint32_t bmpPos = 0;       // Next pixel position in file
-  int loadWidth, loadHeight, // Region being loaded (clipped)
-      loadX, loadY;          // "
-  int row, col;              // Current pixel pos.
-  uint8_t r, g, b;           // Current pixel color
-  uint8_t bitIn = 0;         // Bit number for 1-bit data in
-  uint8_t bitOut = 0;        // Column mask for 1-bit data out
-
-  // If an SPIFFS_Image object is passed and currently contains anything,
-  // free its contents as it's about to be overwritten with new stuff.
-  img->dealloc();
-
-  // Open requested file on SD card
-  if (!(file = SPIFFS.open(filename, FILE_READ)))
-  {
+  if (!black.getBuffer() || (red && !red->getBuffer()))
+    return IMAGE_ERR_MALLOC;
+  // Planes are addressed as raw buffers, one stride for both
+  if (black.getRotation() ||
+      (red && (red->getRotation() || (red->width() != black.width()) ||
+               (red->height() != black.height()))))
+    return IMAGE_ERR_FORMAT;
+  if (!(file = filesys->open(filename, FILE_READ)))
     return IMAGE_ERR_FILE_NOT_FOUND;
-  }
 
-  // Parse BMP header. 0x4D42 (ASCII 'BM') is the Windows BMP signature.
-  // There are other values possible in a .BMP file but these are super
-  // esoteric (e.g. OS/2 struct bitmap array) and NOT supported here!
-  if (readLE16() == 0x4D42)
-  {                      // BMP signature
-    (void)readLE32();    // Read & ignore file size
-    (void)readLE32();    // Read & ignore creator bytes
-    offset = readLE32(); // Start of image data
-    // Read DIB header
-    headerSize = readLE32();
-    bmpWidth = readLE32();
-    bmpHeight = readLE32();
-    // If bmpHeight is negative, image is in top-down order.
-    // This is not canon but has been observed in the wild.
-    if (bmpHeight < 0)
-    {
-      bmpHeight = -bmpHeight;
-      flip = false;
-    }
-    planes = readLE16();
-    depth = readLE16(); // Bits per pixel
-    // Compression mode is present in later BMP versions (default = none)
-    if (headerSize > 12)
-    {
-      compression = readLE32();
-      (void)readLE32();    // Raw bitmap data size; ignore
-      (void)readLE32();    // Horizontal resolution, ignore
-      (void)readLE32();    // Vertical resolution, ignore
-      colors = readLE32(); // Number of colors in palette, or 0 for 2^depth
-      (void)readLE32();    // Number of colors used (ignore)
-      // File position should now be at start of palette (if present)
-    }
-    if (!colors)
-      colors = 1 << depth;
-
-    loadWidth = bmpWidth;
-    loadHeight = bmpHeight;
-    loadX = 0;
-    loadY = 0;
-    if ((planes == 1) && (compression == 0))
-    { // Only uncompressed is handled
-
-      // BMP rows are padded (if needed) to 4-byte boundary
-      rowSize = ((depth * bmpWidth + 31) / 32) * 4;
-
-      if (depth == 24)
-      { // BGR
-        bool allDestsCreated = true;
-        img->w = bmpWidth;
-        img->h = bmpHeight;
-
-        // Loading to RAM -- allocate GFX 16-bit canvas type
-        status = IMAGE_ERR_MALLOC; // Assume won't fit to start
-        uint16_t remainingHeight = bmpHeight;
-        for (int i = 0; allDestsCreated && remainingHeight > 0 && i < NUM_CANVAS; i++)
-        {
-          uint16_t canvasHeight = remainingHeight > CANVAS_HEIGHT ? CANVAS_HEIGHT : remainingHeight;
-          remainingHeight -= CANVAS_HEIGHT;
-          if (!(img->canvas[i] = new GFXcanvas16(bmpWidth, canvasHeight)))
-            allDestsCreated = false;
-        }
-
-        if (allDestsCreated)
-        { // Supported format, alloc OK, etc.
-          uint8_t currentCanvasIndex = 0;
-          GFXcanvas16 *currentCanvas = img->canvas[currentCanvasIndex];
-          uint16_t *currentDest = currentCanvas->getBuffer();
-          status = IMAGE_SUCCESS;
-
-          img->format = IMAGE_16; // Is a GFX 16-bit canvas type
+  if ((readHeader(file, hdr) == IMAGE_SUCCESS) && (hdr.planes == 1) &&
+      (hdr.compression == 0) && (hdr.width > 0) &&
+      (hdr.width <= MAX_WIDTH) && (hdr.height > 0) &&
+      ((hdr.depth == 16) || (hdr.depth == 24) || (hdr.depth == 32)))
+  {
+    EPDDest ed;
+    ed.black = black.getBuffer();
+    ed.red = red ? red->getBuffer() : NULL;
+    ed.stride = (black.width() + 7) / 8;
+    ed.width = (hdr.width < black.width()) ? hdr.width : black.width();
+    ed.height = black.height();
+    ed.channels = red ? 3 : 1;
+    ed.err = ed.next = NULL;
 
-          if (depth >= 16)
-          {
-            for (row = 0; currentCanvasIndex < NUM_CANVAS && row < loadHeight; row++)
-            { // For each scanline...; so not process rows larger than image canvas array
-
-              yield(); // Keep ESP8266 happy
-
-              // Seek to start of scan line.  It might seem labor-intensive
-              // to be doing this on every line, but this method covers a
-              // lot of gritty details like cropping, flip and scanline
-              // padding. Also, the seek only takes place if the file
-              // position actually needs to change (avoids a lot of cluster
-              // math in SD library).
-              if (flip) // Bitmap is stored bottom-to-top order (normal BMP)
-                bmpPos = offset + (bmpHeight - 1 - (row + loadY)) * rowSize;
-              else // Bitmap is stored top-to-bottom
-                bmpPos = offset + (row + loadY) * rowSize;
-              bmpPos += loadX * 3;
-              if (file.position() != bmpPos)
-              {                        // Need seek?
-                file.seek(bmpPos);     // Seek = SD transaction
-                srcidx = sizeof sdbuf; // Force buffer reload
-              }
-              for (col = 0; col < loadWidth; col++)
-              { // For each pixel...
-                if (srcidx >= sizeof sdbuf)
-                {                                 // Time to load more?
-                                                  // Canvas is simpler,
-                  file.read(sdbuf, sizeof sdbuf); // just load sdbuf
-                  srcidx = 0;                     // Reset bmp buf index
-                }
-                // Convert each pixel from BMP to 565 format, save in dest
-                b = sdbuf[srcidx++];
-                g = sdbuf[srcidx++];
-                r = sdbuf[srcidx++];
-                currentDest[destidx++] =
-                    ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
-
-                if (destidx >= currentCanvas->width() * currentCanvas->height())
-                {
-                  // canvas full, switch to next one
-                  destidx = 0;
-                  currentCanvasIndex++;
-                  if (currentCanvasIndex < NUM_CANVAS)
-                  {
-                    currentCanvas = img->canvas[currentCanvasIndex];
-                    currentDest = currentCanvas->getBuffer();
-                  }
-                }
-              } // end pixel loop
-            }   // end scanline loop
-          }     // end depth>24 or quantized malloc OK
-        }       // end malloc check
-      }         // end depth check
-    }           // end planes/compression check
-  }             // end signature
+    // Two scanlines of error, one spare entry at either end
+    uint32_t errSize = (ed.width + 2) * ed.channels * sizeof(int16_t);
+    if ((dither == DITHER_DIFFUSE) &&
+        (!(ed.err = (int16_t *)calloc(2, errSize))))
+    {
+      status = IMAGE_ERR_MALLOC;
+    }
+    else
+    {
+      const RowSink *sinks;
+      switch (dither)
+      {
+      case DITHER_DIFFUSE:
+        ed.next = ed.err + errSize / sizeof(int16_t);
+        sinks = epdSinks<DITHER_DIFFUSE>();
+        break;
+      case DITHER_ORDERED:
+        sinks = epdSinks<DITHER_ORDERED>();
+        break;
+      default:
+        sinks = epdSinks<DITHER_NONE>();
+        break;
+      }
+      int16_t *errBlock = ed.err; // Sink swaps err and next
+      uint32_t sdbuf[SDBUF_WORDS];
+      uint16_t bufSize;
+      uint8_t *buf = allocReadBlock((uint8_t *)sdbuf, sizeof sdbuf, bufSize);
+      if (scanRows(file, hdr, 0, hdr.height, buf, bufSize,
+                   sinks[hdr.depth / 8 - 2], &ed))
+        status = IMAGE_SUCCESS;
+      if (buf != (uint8_t *)sdbuf)
+        free(buf);
+      free(errBlock);
+    }
+  }
 
   file.close();
   return status;
@@ -417,26 +4105,18 @@ ImageReturnCode SPIFFS_ImageReader::bmpDimensions(char *filename,
 {
 
   ImageReturnCode status = IMAGE_ERR_FILE_NOT_FOUND; // Guilty until innocent
+  File file;
+  SPIFFS_BMPHeader hdr;
 
-  if ((file = SPIFFS.open(filename, FILE_READ)))
-  {                            // Open requested file
-    status = IMAGE_ERR_FORMAT; // File's there, might not be BMP tho
-    if (readLE16() == 0x4D42)
-    {                   // BMP signature?
-      (void)readLE32(); // Read & ignore file size
-      (void)readLE32(); // Read & ignore creator bytes
-      (void)readLE32(); // Read & ignore position of image data
-      (void)readLE32(); // Read & ignore header size
+  if ((file = filesys->open(filename, FILE_READ)))
+  { // Open requested file
+    // File's there, might not be BMP tho
+    if ((status = readHeader(file, hdr)) == IMAGE_SUCCESS)
+    {
       if (width)
-        *width = readLE32();
+        *width = hdr.width;
       if (height)
-      {
-        int32_t h = readLE32(); // Don't abs() this, may be a macro
-        if (h < 0)
-          h = -h; // Do manually instead
-        *height = h;
-      }
-      status = IMAGE_SUCCESS; // YAY.
+        *height = hdr.height;
     }
   }
 
@@ -447,44 +4127,135 @@ ImageReturnCode SPIFFS_ImageReader::bmpDimensions(char *filename,
 // UTILITY FUNCTIONS *******************************************************
 
 /*!
-    @brief   Reads a little-endian 16-bit unsigned value from currently-
-             open File, converting if necessary to the microcontroller's
-             native endianism. (BMP files use little-endian values.)
+    @brief   Reads the BMP file header and DIB header from an open File
+             with a single read call and decodes them from memory. File
+             position is left past the header block; callers seek to
+             hdr.offset before reading pixel data.
+    @param   file
+             Open BMP file, positioned at the start.
+    @param   hdr
+             SPIFFS_BMPHeader struct, filled in on success.
+    @return  IMAGE_SUCCESS if the file has a Windows BMP signature and a
+             readable header, else IMAGE_ERR_FORMAT.
+*/
+ImageReturnCode SPIFFS_ImageReader::readHeader(File &file,
+                                               SPIFFS_BMPHeader &hdr)
+{
+  uint8_t buf[BMP_HEADER_BYTES];
+
+  // Short files (or OS/2 headers, which end early) may not fill the
+  // whole block; anything past the core header is checked against the
+  // number of bytes actually read.
+  size_t len = file.read(buf, sizeof buf);
+
+  // 0x4D42 (ASCII 'BM') is the Windows BMP signature. There are other
+  // values possible in a .BMP file but these are super esoteric (e.g.
+  // OS/2 struct bitmap array) and NOT supported here!
+  if ((len < 26) || (readLE16(buf) != 0x4D42))
+    return IMAGE_ERR_FORMAT;
+
+  // Bytes 2-9 are file size and creator bytes, ignored
+  hdr.offset = readLE32(&buf[10]);     // Start of image data
+  hdr.headerSize = readLE32(&buf[14]); // DIB header size
+  hdr.compression = 0;                 // Default = none
+  hdr.colors = 0;                      // Default = 2^depth
+  if (hdr.headerSize == 12)
+  { // BITMAPCOREHEADER, 16-bit dimensions
+    hdr.width = (int16_t)readLE16(&buf[18]);
+    hdr.height = (int16_t)readLE16(&buf[20]);
+    hdr.planes = readLE16(&buf[22]);
+    hdr.depth = readLE16(&buf[24]);
+  }
+  else
+  {
+    if (len < 30)
+      return IMAGE_ERR_FORMAT;
+    hdr.width = (int32_t)readLE32(&buf[18]);
+    hdr.height = (int32_t)readLE32(&buf[22]);
+    hdr.planes = readLE16(&buf[26]);
+    hdr.depth = readLE16(&buf[28]); // Bits per pixel
+    // Compression mode is present in later BMP versions
+    if (len >= 50)
+    {
+      hdr.compression = readLE32(&buf[30]);
+      // Raw bitmap data size, horizontal & vertical resolution ignored
+      hdr.colors = readLE32(&buf[46]); // Colors in palette, 0 for 2^depth
+      // Number of colors used (bytes 50-53) ignored
+    }
+  }
+  // If height is negative, image is in top-down order.
+  // This is not canon but has been observed in the wild.
+  hdr.flip = true;
+  if (hdr.height < 0)
+  {
+    hdr.height = -hdr.height; // Don't abs() this, may be a macro
+    hdr.flip = false;
+  }
+  if (!hdr.colors && (hdr.depth < 32))
+    hdr.colors = 1UL << hdr.depth;
+
+  return IMAGE_SUCCESS;
+}
+
+/*!
+    @brief   Decodes a little-endian 16-bit unsigned value from a memory
+             buffer, independent of the microcontroller's native
+             endianism or alignment. (BMP files use little-endian values.)
+    @param   buf
+             Pointer to the first (least significant) byte.
     @return  Unsigned 16-bit value, native endianism.
 */
-uint16_t SPIFFS_ImageReader::readLE16(void)
+uint16_t SPIFFS_ImageReader::readLE16(const uint8_t *buf)
 {
-#if !defined(ESP32) && !defined(ESP8266) && \
-    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-  // Read directly into result -- BMP data and variable both little-endian.
-  uint16_t result;
-  file.read(&result, sizeof result);
-  return result;
-#else
-  // Big-endian or unknown. Byte-by-byte read will perform reversal if needed.
-  return file.read() | ((uint16_t)file.read() << 8);
-#endif
+  return buf[0] | ((uint16_t)buf[1] << 8);
 }
 
 /*!
-    @brief   Reads a little-endian 32-bit unsigned value from currently-
-             open File, converting if necessary to the microcontroller's
-             native endianism. (BMP files use little-endian values.)
+    @brief   Decodes a little-endian 32-bit unsigned value from a memory
+             buffer, independent of the microcontroller's native
+             endianism or alignment. (BMP files use little-endian values.)
+    @param   buf
+             Pointer to the first (least significant) byte.
     @return  Unsigned 32-bit value, native endianism.
 */
-uint32_t SPIFFS_ImageReader::readLE32(void)
+uint32_t SPIFFS_ImageReader::readLE32(const uint8_t *buf)
 {
-#if !defined(ESP32) && !defined(ESP8266) && \
-    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-  // Read directly into result -- BMP data and variable both little-endian.
-  uint32_t result;
-  file.read(&result, sizeof result);
-  return result;
-#else
-  // Big-endian or unknown. Byte-by-byte read will perform reversal if needed.
-  return file.read() | ((uint32_t)file.read() << 8) |
-         ((uint32_t)file.read() << 16) | ((uint32_t)file.read() << 24);
-#endif
+  return buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) |
+         ((uint32_t)buf[3] << 24);
+}
+
+/*!
+    @brief   Encodes a 16-bit value as little-endian bytes in a memory
+             buffer, independent of the microcontroller's native
+             endianism or alignment.
+    @param   buf
+             Pointer to the first of two bytes to write.
+    @param   value
+             Value to encode.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::writeLE16(uint8_t *buf, uint16_t value)
+{
+  buf[0] = value;
+  buf[1] = value >> 8;
+}
+
+/*!
+    @brief   Encodes a 32-bit value as little-endian bytes in a memory
+             buffer, independent of the microcontroller's native
+             endianism or alignment.
+    @param   buf
+             Pointer to the first of four bytes to write.
+    @param   value
+             Value to encode.
+    @return  None (void).
+*/
+void SPIFFS_ImageReader::writeLE32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value;
+  buf[1] = value >> 8;
+  buf[2] = value >> 16;
+  buf[3] = value >> 24;
 }
 
 /*!
@@ -18,10 +18,17 @@
  * #define NUM_CANVAS 12
  * #define CANVAS_HEIGHT 20
  * --> max image height = 12*20 = 240px
+ * (drawBMP() and drawGrid() stream strip by strip and have no such limit)
  */
 #define NUM_CANVAS 12
 #define CANVAS_HEIGHT 20
 
+/// Bytes for one flag bit per image row
+#define ROW_FLAG_BYTES ((NUM_CANVAS * CANVAS_HEIGHT + 7) / 8)
+
+/// Bytes for one flag bit per palette index of an indexed image
+#define PALETTE_FLAG_BYTES (256 / 8)
+
 #include "SPIFFS.h"
 #include "Adafruit_SPITFT.h"
 
@@ -41,9 +48,107 @@ enum ImageReturnCode
 enum ImageFormat
 {
   IMAGE_NONE, // No image was loaded; IMAGE_ERR_* condition
+  IMAGE_1,    // GFXcanvas1 image with a 2-color 565 palette (SUPPORTED)
+  IMAGE_8,    // GFXcanvas8 indexed image with a 565 palette (SUPPORTED)
   IMAGE_16    // GFXcanvas16 image (SUPPORTED)
 };
 #endif
+
+/** In-RAM storage used by loadBMP() for 16-bit images */
+enum ImageCompression
+{
+  COMPRESS_NONE, // GFXcanvas16 strips, 2 bytes/pixel (default)
+  COMPRESS_RLE,  // Run-length coded strips, expanded at draw()
+  COMPRESS_BC1   // 4 bits/pixel BC1 (DXT1) blocks, lossy, decoded at draw()
+};
+
+/** Pixel layouts written by SPIFFS_ImageReader::loadNative(). Packed
+    formats follow controller RAM, where higher values are brighter and a
+    set PIXEL_MONO bit is a white (or lit) pixel; this is the inverse of
+    loadEPD() planes, where a set bit is ink. */
+enum PixelFormat
+{
+  PIXEL_RGB565, // 2 bytes/pixel, high byte first as sent over SPI
+  PIXEL_BGR565, // PIXEL_RGB565 with red and blue swapped, for BGR panels
+  PIXEL_RGB666, // 3 bytes/pixel R, G, B, 6 bits each at the top (ILI9488)
+  PIXEL_GRAY2,  // 2 bits/pixel, 4 gray levels (3 = white), MSB = leftmost
+  PIXEL_MONO    // 1 bit/pixel, 1 = white (not ink), MSB = leftmost
+};
+
+/** Dithering used by SPIFFS_ImageReader::loadEPD() */
+enum ImageDither
+{
+  DITHER_NONE,    // Nearest ink color per pixel, flat art and text
+  DITHER_ORDERED, // 4x4 Bayer pattern, regular texture, no error buffer
+  DITHER_DIFFUSE  // Floyd-Steinberg error diffusion, smoothest photos
+};
+
+/** Resampling used by SPIFFS_Image::drawScaled() */
+enum ImageScaling
+{
+  SCALE_NEAREST, // Nearest source pixel, fastest, blocky when enlarging
+  SCALE_BILINEAR // Weighted average of the 4 nearest source pixels
+};
+
+/*!
+   @brief  Fields of a BMP file header plus DIB header, decoded from one
+           block read by SPIFFS_ImageReader::readHeader().
+*/
+struct SPIFFS_BMPHeader
+{
+  uint32_t offset;      ///< Start of image data in file
+  uint32_t headerSize;  ///< DIB header size, indicates BMP version
+  int32_t width;        ///< Image width in pixels
+  int32_t height;       ///< Image height in pixels (always positive)
+  bool flip;            ///< true if stored bottom-to-top (normal BMP)
+  uint16_t planes;      ///< Number of planes (must be 1)
+  uint16_t depth;       ///< Bits per pixel
+  uint32_t compression; ///< Compression mode (0 = none)
+  uint32_t colors;      ///< Number of colors in palette
+};
+
+/*!
+   @brief  A 565-to-565 color transform for SPIFFS_Image::draw(), so one
+           loaded image can be shown as normal, disabled, highlighted or
+           night-mode variants. Held as one lookup table per channel
+           (plus an optional grayscale step before them), so applying it
+           costs three table reads per pixel whatever it was built from.
+           Starts as identity; each builder call is applied on top of the
+           previous ones.
+*/
+class SPIFFS_ColorTransform
+{
+public:
+  SPIFFS_ColorTransform(void);
+  void reset(void);
+  void brightness(uint16_t percent);
+  void tint(uint16_t color, uint8_t amount);
+  void invert(void);
+  void grayscale(void);
+  /*!
+      @brief   Transform one pixel.
+      @param   c
+               RGB565 color.
+      @return  Transformed RGB565 color.
+  */
+  uint16_t apply(uint16_t c) const
+  {
+    uint8_t r = c >> 11, g = (c >> 5) & 0x3F, b = c & 0x1F;
+    if (gray)
+    { // Luma with weights 77/150/29 of 256, as 6 bits
+      g = (r * 154 + g * 150 + b * 58 + 128) >> 8;
+      r = b = g >> 1;
+    }
+    return (red[r] << 11) | (green[g] << 5) | blue[b];
+  }
+
+protected:
+  uint8_t red[32];   ///< New red for each 5-bit red value
+  uint8_t green[64]; ///< New green for each 6-bit green value
+  uint8_t blue[32];  ///< New blue for each 5-bit blue value
+  bool gray;         ///< Convert to gray before the tables
+};
+
 /*!
    @brief  Data bundle returned with an image loaded to RAM. Used by
            ImageReader.loadBMP() and Image.draw(), not ImageReader.drawBMP().
@@ -56,6 +161,42 @@ public:
   int16_t width(void) const;  // Return image width in pixels
   int16_t height(void) const; // Return image height in pixels
   void draw(Adafruit_SPITFT &tft, int16_t x, int16_t y);
+  void draw(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+            const SPIFFS_ColorTransform &transform);
+  void draw(Adafruit_GFX &gfx, int16_t x, int16_t y);
+  void draw(GFXcanvas16 &dest, int16_t x, int16_t y);
+  void drawScaled(Adafruit_SPITFT &tft, int16_t x, int16_t y, int16_t width,
+                  int16_t height, ImageScaling mode = SCALE_BILINEAR);
+  bool setNinePatch(uint16_t left, uint16_t top, uint16_t right,
+                    uint16_t bottom);
+  void drawNinePatch(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                     int16_t width, int16_t height);
+  void drawTiled(Adafruit_SPITFT &tft, int16_t x, int16_t y, int16_t width,
+                 int16_t height);
+  void setPalette(uint8_t first, uint16_t count, const uint16_t *colors);
+  void rotatePalette(uint8_t first, uint16_t count);
+  void drawChanged(Adafruit_SPITFT &tft, int16_t x, int16_t y);
+  /*!
+      @brief   Get a palette entry of an indexed (IMAGE_1 or IMAGE_8)
+               image.
+      @param   index
+               Palette index, 0 to 1 (IMAGE_1) or 255 (IMAGE_8).
+      @return  RGB565 color, 0 if the image has no such entry.
+  */
+  uint16_t getPaletteColor(uint8_t index) const
+  {
+    return (index < numColors) ? palette[index] : 0;
+  }
+  uint32_t releaseStrips(void);
+  /*!
+      @brief   Set eviction priority of an image from openBMP(); under
+               memory pressure lower priorities are released first.
+      @param   p
+               Priority, 0 (default, released first) to 255.
+  */
+  void setPriority(uint8_t p) { priority = p; }
+  static uint32_t releaseMemory(uint32_t bytes);
+  static bool registerPressureHandler(void);
   /*!
       @brief   Return canvas image format.
       @return  An ImageFormat type: IMAGE_1 for a GFXcanvas1, IMAGE_8 for
@@ -66,9 +207,77 @@ public:
 
 protected:
   uint16_t w, h;
-  GFXcanvas16 *canvas[NUM_CANVAS]; // Canvas object if 16bpp;
+  GFXcanvas16 *canvas[NUM_CANVAS]; // Canvas object if 16bpp; NULL if uniform
+  GFXcanvas8 *canvas8[NUM_CANVAS]; ///< Index strips if IMAGE_8
+  GFXcanvas1 *canvas1[NUM_CANVAS]; ///< Bit strips if IMAGE_1
+  uint16_t *palette;               ///< numColors 565 colors, or NULL
+  uint16_t numColors;              ///< Palette size, 0 unless indexed
+  uint8_t *rowIndices;             ///< Per row, flag bit per index used
+  uint8_t changed[PALETTE_FLAG_BYTES]; ///< Indices set since drawChanged()
+  uint16_t solidColor[NUM_CANVAS]; ///< Color of strips without canvas
+  uint8_t solidRows[ROW_FLAG_BYTES]; ///< Rows that are a single color
+  uint8_t runRows[ROW_FLAG_BYTES];   ///< Rows with long single-color runs
+  uint8_t *packed[NUM_CANVAS];     ///< Compressed strip data, or NULL
+  bool resident[NUM_CANVAS];       ///< Strip content is in RAM
+  uint8_t compression;             ///< ImageCompression of packed strips
   uint8_t format;                  ///< Canvas bundle type in use
+  uint16_t patchLeft;              ///< Nine-patch fixed columns at left
+  uint16_t patchTop;               ///< Nine-patch fixed rows at top
+  uint16_t patchRight;             ///< Nine-patch fixed columns at right
+  uint16_t patchBottom;            ///< Nine-patch fixed rows at bottom
+  fs::FS *filesys;                 ///< Filesystem of a lazy image
+  char *path;                      ///< File of a lazy image, else NULL
+  SPIFFS_BMPHeader bmp;            ///< Header of a lazy image's file
+  uint8_t priority;                ///< Eviction priority, low goes first
+  uint8_t busy;                    ///< Draws in progress, evicted if 0
+  uint32_t lastUse;                ///< useCounter at last draw
+  SPIFFS_Image *next;              ///< Next image in lazyImages
+  static SPIFFS_Image *lazyImages; ///< Registry of images from openBMP()
+  static uint32_t useCounter;      ///< Draw counter for LRU eviction
+  static bool hookInstalled;       ///< pressureHandler() is registered
+  static volatile bool hookMissed; ///< pressureHandler() found it locked
   void dealloc(void);              ///< Free/deinitialize variables
+  uint8_t numStrips(void) const;
+  uint16_t stripHeight(uint8_t i) const;
+  uint32_t stripBytes(uint8_t i) const;
+  bool allocStrips(void);
+  bool allocIndexed(uint8_t depth);
+  void findSpans(uint8_t i);
+  void findIndices(uint8_t i);
+  void expandRow(uint16_t row, uint16_t *dest) const;
+  void compressStrip(uint8_t i);
+  void finishStrip(uint8_t i);
+  bool loadStrip(uint8_t i);
+  uint32_t freeStrips(void);
+  void link(void);
+  void unlink(void);
+  void setBusy(bool inUse);
+  /*!
+      @brief  Keeps eviction away from the strips of a lazy image while
+              it is being drawn or read, for as long as the object lives.
+  */
+  class BusyScope
+  {
+  public:
+    BusyScope(SPIFFS_Image &img);
+    ~BusyScope(void);
+
+  private:
+    SPIFFS_Image &image; ///< Image marked busy, if lazily loaded
+  };
+  static uint32_t evict(uint32_t bytes);
+  static void pressureHandler(size_t size, uint32_t caps,
+                              const char *function_name);
+  uint16_t *stripPixels(uint8_t i, uint16_t *scratch) const;
+  uint32_t scratchPixels(void) const;
+  const uint16_t *rowPixels(uint16_t row, uint16_t *scratch,
+                            uint8_t &cached);
+  void drawRuns(Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                uint16_t *px) const;
+  template <class GFX>
+  void drawRows(GFX &gfx, int16_t x, int16_t y,
+                const SPIFFS_ColorTransform *transform,
+                const uint8_t *indices);
   friend class SPIFFS_ImageReader; ///< Loading occurs here
 };
 
@@ -83,21 +292,65 @@ protected:
            its mere inclusion. The syntaxes can therefore be a bit
            bizarre (passing display object as an argument), see examples
            for use.
+
+           The reader holds no per-load state: each call opens its own
+           File and keeps all decode state on the stack, so one reader
+           may be used from several FreeRTOS tasks at once, provided each
+           task loads into its own SPIFFS_Image.
 */
 class SPIFFS_ImageReader
 {
 public:
-  SPIFFS_ImageReader();
+  explicit SPIFFS_ImageReader(fs::FS &fs = SPIFFS);
   ~SPIFFS_ImageReader(void);
+  ImageReturnCode drawBMP(char *filename, Adafruit_SPITFT &tft, int16_t x,
+                          int16_t y);
+  ImageReturnCode drawGrid(char **filenames, uint8_t count,
+                           Adafruit_SPITFT &tft, int16_t x, int16_t y,
+                           int16_t cellWidth, int16_t cellHeight,
+                           uint8_t columns);
+  ImageReturnCode drawProgressive(char *filename, Adafruit_SPITFT &tft,
+                                  int16_t x, int16_t y);
   ImageReturnCode loadBMP(char *filename, SPIFFS_Image &img);
+  ImageReturnCode openBMP(char *filename, SPIFFS_Image &img);
+  ImageReturnCode savePyramid(char *filename, SPIFFS_Image &img);
+  ImageReturnCode loadPyramid(char *filename, SPIFFS_Image &img,
+                              int16_t maxWidth, int16_t maxHeight);
+  ImageReturnCode saveInterlaced(char *filename, SPIFFS_Image &img);
+  ImageReturnCode loadNative(char *filename, PixelFormat fmt, uint8_t *dest,
+                             uint32_t size);
+  static uint32_t nativeRowBytes(PixelFormat fmt, int32_t width);
+  ImageReturnCode loadEPD(char *filename, GFXcanvas1 &black,
+                          GFXcanvas1 *red = NULL,
+                          ImageDither dither = DITHER_DIFFUSE);
   ImageReturnCode bmpDimensions(char *filename, int32_t *w, int32_t *h);
   void printStatus(ImageReturnCode stat, Stream &stream = Serial);
+  void setBands(uint8_t n);
+  void setCompression(ImageCompression mode);
+  void setSidecarCache(bool enable);
 
 protected:
-  File file; ///< Current Open file
+  fs::FS *filesys; ///< Filesystem images are read from
+  uint8_t bands; ///< Row bands decoded in parallel by loadBMP()
+  uint8_t compression; ///< ImageCompression applied by loadBMP()
+  bool sidecar; ///< loadBMP() reads/writes pre-converted .565 files
   ImageReturnCode coreBMP(char *filename, SPIFFS_Image *img);
-  uint16_t readLE16(void);
-  uint32_t readLE32(void);
+  static ImageReturnCode loadIndexed(File &file, const SPIFFS_BMPHeader &hdr,
+                                     SPIFFS_Image *img);
+  ImageReturnCode streamBMP(char *filename, Adafruit_SPITFT &tft, int16_t x,
+                            int16_t y, int16_t cellWidth, int16_t cellHeight,
+                            GFXcanvas16 *&band, uint8_t *buf,
+                            uint16_t bufSize);
+  static bool sidecarName(const char *filename, char *name);
+  static bool readRaw(File &file, SPIFFS_Image *img);
+  bool loadSidecar(File &bmpFile, const char *filename, SPIFFS_Image *img);
+  void writeSidecar(File &bmpFile, const char *filename,
+                    const SPIFFS_Image *img);
+  static ImageReturnCode readHeader(File &file, SPIFFS_BMPHeader &hdr);
+  static uint16_t readLE16(const uint8_t *buf);
+  static uint32_t readLE32(const uint8_t *buf);
+  static void writeLE16(uint8_t *buf, uint16_t value);
+  static void writeLE32(uint8_t *buf, uint32_t value);
 };
 
 #endif // __SPIFFS_IMAGE_READER_H__